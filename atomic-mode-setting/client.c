@@ -2,10 +2,13 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <xf86drm.h>
+
 #include "share.h"
 
 #define TARGET_SIZE 256
@@ -27,12 +30,53 @@ static const char fragment_shader[] =
 	"    gl_FragColor = vec4(1.0, 0.0, 0.0, 1);"
 	"}";
 
-static int render(uint64_t index, int wait_fd)
+// client side of a buffer in the pool, registered to server
+struct buffer {
+	uint32_t id;
+	struct gbm_bo *bo;
+	EGLImageKHR image;
+	GLuint renderbuffer;
+	GLuint fbo;
+
+	// server is using it to composite or scan out
+	bool busy;
+	// order it's released by server, earliest released one is reused
+	// first
+	uint64_t released;
+	// signaled when server is done with it, -1 if none
+	int release_fd;
+};
+
+// buffers allocated up front and rendered through fbos
+static struct buffer *pool = NULL;
+static uint32_t pool_size = 0;
+static uint64_t release_count = 0;
+
+// registered buffers indexed by id, which is given by server
+static struct buffer **buffers = NULL;
+static uint32_t num_buffers = 0;
+
+static struct buffer *find_buffer(uint32_t id)
 {
-	// start GPU task after server is done with this render buffer
-	if (wait_fd >= 0) {
-		wait_fence(state.display, wait_fd);
-		close(wait_fd);
+	assert(id < num_buffers && buffers[id]);
+	return buffers[id];
+}
+
+// area covered by the triangle in previous frame
+static struct damage_rect last_area = {0};
+
+// frame is the vblank sequence to show this frame when known, otherwise
+// the frame index
+static int render(struct buffer *buffer, uint64_t frame, struct damage_rect *damage)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, buffer->fbo);
+
+	// only drawing to this buffer waits for server to be done with it,
+	// both composite and scanout may use it
+	if (buffer->release_fd >= 0) {
+		wait_fence(state.display, buffer->release_fd);
+		close(buffer->release_fd);
+		buffer->release_fd = -1;
 	}
 
 	GLfloat vertex[] = {
@@ -49,10 +93,12 @@ static int render(uint64_t index, int wait_fd)
 	static const int seconds_per_round = 5;
 	static const int monitor_fps = 60;
 	static const double pi = 3.1415926;
-	double sita = (2 * pi) / (seconds_per_round * monitor_fps) * index;
+	double sita = (2 * pi) / (seconds_per_round * monitor_fps) * frame;
+	// fbo origin is at the first row of buffer while server reads it
+	// from top left, so flip Y
 	GLfloat matrix[] = {
 		cos(sita), 0, sin(sita),
-		0, 1, 0,
+		0, -1, 0,
 		-sin(sita), 0, cos(sita),
 	};
 
@@ -66,85 +112,337 @@ static int render(uint64_t index, int wait_fd)
 	// after this GPU task is done, this fence will be signaled
 	int signal_fd = get_fence(state.display);
 
-	// swap back buffer to front
-	eglSwapBuffers(state.display, state.surface);
+	// triangle only changes horizontally, area covered by it in either
+	// previous or this frame is damaged
+	int32_t half = fabs(cos(sita)) * state.target_width / 2 + 1;
+	if (half > state.target_width / 2)
+		half = state.target_width / 2;
+	struct damage_rect area = {
+		.x = state.target_width / 2 - half,
+		.y = 0,
+		.width = half * 2,
+		.height = state.target_height,
+	};
+	*damage = area.width > last_area.width ? area : last_area;
+	last_area = area;
 
 	return signal_fd;
 }
 
-// assume max number of bos in a gbm_surface is less than 32
-#define MAX_BOS 32
-static struct gbm_bo *busy_bos[MAX_BOS] = {0};
+// timeline syncobjs shared with server, 0 when fences are passed by fds,
+// transfer moves fences between them and sync_files
+static uint32_t acquire_syncobj = 0;
+static uint32_t release_syncobj = 0;
+static uint32_t transfer_syncobj = 0;
+static uint64_t acquire_point = 0;
+
+// time when frames are sent to server by index, a buffer may be presented
+// again before feedback of its previous frame arrives, assume feedback
+// comes within 64 frames
+#define MAX_PRESENT_TIMES 64
+static uint64_t present_times[MAX_PRESENT_TIMES] = {0};
+
+// latest frame shown on screen
+static struct present_feedback last_feedback = {0};
+// frames replaced before shown on screen
+static uint64_t skipped_frames = 0;
+
+static void handle_feedback(struct present_feedback *data)
+{
+	last_feedback = *data;
+
+	// report latency from present to on screen once per second
+	uint64_t latency = data->timestamp - present_times[data->index % MAX_PRESENT_TIMES];
+	if (data->index % 60 == 0)
+		printf("frame %llu present latency %.3f ms, refresh %.3f ms, "
+		       "skipped %llu\n",
+		       (unsigned long long)data->index, latency / 1000000.0,
+		       data->refresh / 1000000.0,
+		       (unsigned long long)skipped_frames);
+}
 
-static void present(int fd, int signal_fd, uint64_t index)
+static void release_buffer(struct present_done *data, int wait_fd)
 {
-	struct gbm_bo *bo = gbm_surface_lock_front_buffer(state.gs);
-	assert(bo);
-
-	struct present_buffer data = {
-		.x = 128,
-		.y = 128,
-		.width = gbm_bo_get_width(bo),
-		.height = gbm_bo_get_height(bo),
-		.stride = gbm_bo_get_stride(bo),
-		.format = gbm_bo_get_format(bo),
-		.index = index,
+	struct buffer *buffer = find_buffer(data->id);
+	buffer->busy = false;
+	buffer->released = ++release_count;
+
+	// waited when the buffer is drawn again
+	if (buffer->release_fd >= 0)
+		close(buffer->release_fd);
+	buffer->release_fd = wait_fd;
+}
+
+// handle one message from server and return its type
+static uint32_t receive(int fd, struct message *msg)
+{
+	int wait_fd = -1;
+	int num_fd = 1;
+	ssize_t size = sock_fd_read(fd, msg, sizeof(*msg), &wait_fd, &num_fd);
+	assert(size > 0);
+
+	switch (msg->type) {
+	case MESSAGE_BUFFER_REGISTERED:
+	case MESSAGE_OUTPUT:
+		break;
+	case MESSAGE_PRESENT_DONE:
+		if (msg->present_done.release_point)
+			assert((wait_fd = syncobj_export(state.fd, transfer_syncobj,
+							 release_syncobj,
+							 msg->present_done.release_point)) >= 0);
+		else if (!num_fd)
+			wait_fd = -1;
+		release_buffer(&msg->present_done, wait_fd);
+		break;
+	case MESSAGE_PRESENT_FEEDBACK:
+		handle_feedback(&msg->present_feedback);
+		break;
+	case MESSAGE_PRESENT_SKIPPED:
+		skipped_frames++;
+		break;
+	default:
+		fprintf(stderr, "invalid server message %d\n", msg->type);
+		exit(1);
+	}
+	return msg->type;
+}
+
+// send bo to server once, later presents only carry the returned id
+static void register_buffer(int fd, struct buffer *buffer)
+{
+	struct gbm_bo *bo = buffer->bo;
+	struct message msg = {
+		.type = MESSAGE_REGISTER_BUFFER,
+		.register_buffer = {
+			.width = gbm_bo_get_width(bo),
+			.height = gbm_bo_get_height(bo),
+			.format = gbm_bo_get_format(bo),
+			.modifier = gbm_bo_get_modifier(bo),
+			.num_planes = gbm_bo_get_plane_count(bo),
+		},
 	};
 
-	int fds[2] = { gbm_bo_get_fd(bo), signal_fd };
-	int num_fd = signal_fd >= 0 ? 2 : 1;
-	ssize_t size = sock_fd_write(fd, &data, sizeof(data), fds, num_fd);
+	assert(msg.register_buffer.num_planes <= MAX_BUFFER_PLANES);
+	for (int i = 0; i < msg.register_buffer.num_planes; i++) {
+		msg.register_buffer.strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+		msg.register_buffer.offsets[i] = gbm_bo_get_offset(bo, i);
+	}
+
+	int bo_fd = gbm_bo_get_fd(bo);
+	ssize_t size = sock_fd_write(fd, &msg, sizeof(msg), &bo_fd, 1);
 	assert(size > 0);
 
 	// close after usage
-	close(fds[0]);
-	if (signal_fd >= 0)
+	close(bo_fd);
+
+	// present done of previous frames may arrive before the reply
+	while (receive(fd, &msg) != MESSAGE_BUFFER_REGISTERED);
+
+	buffer->id = msg.buffer_registered.id;
+	if (buffer->id >= num_buffers) {
+		uint32_t num = buffer->id + 1;
+		buffers = realloc(buffers, sizeof(*buffers) * num);
+		assert(buffers);
+		memset(buffers + num_buffers, 0, sizeof(*buffers) * (num - num_buffers));
+		num_buffers = num;
+	}
+	buffers[buffer->id] = buffer;
+}
+
+// allocate and register all buffers up front, each is rendered through
+// an fbo backed by EGLImage of its bo
+static void create_pool(int fd, uint32_t num)
+{
+	assert(epoxy_has_gl_extension("GL_OES_EGL_image"));
+
+	pool = calloc(num, sizeof(*pool));
+	assert(pool);
+	pool_size = num;
+
+	for (uint32_t i = 0; i < num; i++) {
+		struct buffer *buffer = pool + i;
+		buffer->release_fd = -1;
+
+		// driver picks the best layout among modifiers server can
+		// scan out
+		if (state.num_modifiers)
+			buffer->bo = gbm_bo_create_with_modifiers(
+				state.gbm, state.target_width, state.target_height,
+				GBM_FORMAT_ARGB8888, state.modifiers, state.num_modifiers);
+		else
+			buffer->bo = gbm_bo_create(
+				state.gbm, state.target_width, state.target_height,
+				GBM_BO_FORMAT_ARGB8888,
+				GBM_BO_USE_LINEAR|GBM_BO_USE_SCANOUT|GBM_BO_USE_RENDERING);
+		assert(buffer->bo);
+
+		buffer->image = eglCreateImageKHR(state.display, EGL_NO_CONTEXT,
+						  EGL_NATIVE_PIXMAP_KHR, buffer->bo, NULL);
+		assert(buffer->image != EGL_NO_IMAGE_KHR);
+
+		glGenRenderbuffers(1, &buffer->renderbuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, buffer->renderbuffer);
+		glEGLImageTargetRenderbufferStorageOES(GL_RENDERBUFFER, buffer->image);
+
+		glGenFramebuffers(1, &buffer->fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, buffer->fbo);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+					  GL_RENDERBUFFER, buffer->renderbuffer);
+		assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+		register_buffer(fd, buffer);
+	}
+}
+
+static void present(int fd, struct buffer *buffer, int signal_fd, uint64_t index,
+		    uint32_t x, uint32_t y, uint64_t target, struct damage_rect *damage)
+{
+	struct message msg = {
+		.type = MESSAGE_PRESENT_BUFFER,
+		.present_buffer = {
+			.x = x,
+			.y = y,
+			.id = buffer->id,
+			.index = index,
+			.target_sequence = target,
+			.num_damage = 1,
+			.damage = { *damage },
+		},
+	};
+
+	// render fence goes to the next acquire point, no fd is sent
+	if (acquire_syncobj) {
+		msg.present_buffer.acquire_point = ++acquire_point;
+		syncobj_import(state.fd, transfer_syncobj, acquire_syncobj,
+			       acquire_point, signal_fd);
+		signal_fd = -1;
+	}
+
+	ssize_t size;
+	if (signal_fd >= 0) {
+		size = sock_fd_write(fd, &msg, sizeof(msg), &signal_fd, 1);
 		close(signal_fd);
+	} else
+		size = sock_fd_write(fd, &msg, sizeof(msg), NULL, 0);
+	assert(size > 0);
 
-	busy_bos[index % MAX_BOS] = bo;
+	buffer->busy = true;
+	present_times[index % MAX_PRESENT_TIMES] = get_time_ns();
 }
 
-static int get_free_buffer(int fd)
+// share timelines with server once, later frames only carry their points
+static void register_timeline(int fd)
 {
-	if (gbm_surface_has_free_buffers(state.gs))
-		return -1;
+	uint64_t cap = 0;
+	assert(!drmGetCap(state.fd, DRM_CAP_SYNCOBJ_TIMELINE, &cap) && cap);
 
-	int wait_fd = -1;
-	int num_fd = 1;
-	struct present_done data;
-	ssize_t size = sock_fd_read(fd, &data, sizeof(data), &wait_fd, &num_fd);
+	assert(!drmSyncobjCreate(state.fd, 0, &acquire_syncobj));
+	assert(!drmSyncobjCreate(state.fd, 0, &release_syncobj));
+	assert(!drmSyncobjCreate(state.fd, 0, &transfer_syncobj));
+
+	int fds[2];
+	assert(!drmSyncobjHandleToFD(state.fd, acquire_syncobj, fds));
+	assert(!drmSyncobjHandleToFD(state.fd, release_syncobj, fds + 1));
+
+	struct message msg = {
+		.type = MESSAGE_REGISTER_TIMELINE,
+	};
+	ssize_t size = sock_fd_write(fd, &msg, sizeof(msg), fds, 2);
 	assert(size > 0);
-	assert(num_fd <= 1);
 
-	struct gbm_bo *bo = busy_bos[data.index % MAX_BOS];
-	busy_bos[data.index % MAX_BOS] = NULL;
-	assert(bo);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+// earliest released buffer, wait for server to release one when all are
+// busy
+static struct buffer *get_free_buffer(int fd)
+{
+	struct message msg;
+
+	while (true) {
+		struct buffer *free_buffer = NULL;
+		for (uint32_t i = 0; i < pool_size; i++) {
+			struct buffer *buffer = pool + i;
+			if (!buffer->busy &&
+			    (!free_buffer || buffer->released < free_buffer->released))
+				free_buffer = buffer;
+		}
+		if (free_buffer)
+			return free_buffer;
+
+		receive(fd, &msg);
+	}
+}
+
+// show a frame every swap_interval vblanks
+static uint32_t swap_interval = 1;
+static uint64_t target_sequence = 0;
+
+static uint64_t next_target(void)
+{
+	// no frame shown yet, show as soon as possible
+	if (!last_feedback.sequence)
+		return 0;
+
+	target_sequence += swap_interval;
+
+	// fall behind, restart from the latest shown frame
+	if (target_sequence <= last_feedback.sequence)
+		target_sequence = last_feedback.sequence + swap_interval;
 
-	gbm_surface_release_buffer(state.gs, bo);
-	return wait_fd;
+	return target_sequence;
 }
 
-void client_main(int fd)
+void client_main(int fd, struct client_config *config)
 {
+	swap_interval = config->interval;
+	uint32_t x = config->x;
+	uint32_t y = config->y;
+
+	// server tells output size and layouts it can scan out first
+	struct message msg;
+	while (receive(fd, &msg) != MESSAGE_OUTPUT);
+	if (config->fullscreen) {
+		state.target_width = msg.output.width;
+		state.target_height = msg.output.height;
+		x = y = 0;
+	}
+
+	static uint64_t modifiers[MAX_MODIFIERS];
+	state.num_modifiers = msg.output.num_modifiers;
+	memcpy(modifiers, msg.output.modifiers, sizeof(modifiers));
+	state.modifiers = modifiers;
+
 	state.fd = open("/dev/dri/renderD128", O_RDWR);
 	assert(state.fd >= 0);
-	
-	// render
+
+	if (config->syncobj)
+		register_timeline(fd);
+
+	// render to buffers of the pool instead of a window surface
+	state.surfaceless = true;
 	render_target_init(&state);
 	init_gles(&state, vertex_shader, fragment_shader);
 
 	// background color
 	glClearColor(0, 0, 0, 0);
 
+	create_pool(fd, config->num_buffers);
+
 	for (uint64_t i = 0; true; i++) {
-		// ensure back buffer is free and release buffer when receive
-		// present done from server
-		int wait_fd = get_free_buffer(fd);
+		// reuse the buffer server released first, buffers are released
+		// when receive present done from server
+		struct buffer *buffer = get_free_buffer(fd);
+
+		// vblank to show this frame, so animation keeps cadence
+		uint64_t target = next_target();
 
 		// do OpenGL rendering
-		int signal_fd = render(i, wait_fd);
+		struct damage_rect damage;
+		int signal_fd = render(buffer, target ? target : i, &damage);
 
 		// send to server for display
-		present(fd, signal_fd, i);
+		present(fd, buffer, signal_fd, i, x, y, target, &damage);
 	}
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -7,361 +8,2793 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/dma-buf.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 #include "share.h"
 
+// kernel headers before 6.0 lack sync_file export and import of dma-buf
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+	__u32 flags;
+	__s32 fd;
+};
+struct dma_buf_import_sync_file {
+	__u32 flags;
+	__s32 fd;
+};
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE	_IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#define DMA_BUF_IOCTL_IMPORT_SYNC_FILE	_IOW(DMA_BUF_BASE, 3, struct dma_buf_import_sync_file)
+#endif
+
 static struct render_state state;
+static struct server_config config;
 
 static int drm_fd;
-static drmModeConnectorPtr connector = NULL;
-static drmModeFBPtr orig_fb;
-static drmModeCrtcPtr crtc;
 
-static void display_init(void)
+struct plane {
+	uint32_t id;
+	// DRM_PLANE_TYPE_*
+	uint64_t type;
+	// stacking order among planes of the crtc, higher is on top
+	uint64_t zpos;
+	uint32_t *formats;
+	int num_formats;
+
+	// property ids, fb_damage_clips is 0 when not supported
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t in_fence_fd;
+	uint32_t fb_damage_clips;
+	uint32_t src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+};
+
+// planes usable by a crtc, [0] is the primary plane which shows the
+// composited output, overlays follow in ascending zpos
+#define MAX_PLANES 8
+
+// screen area in output coordinates with origin at top left
+struct region {
+	int num;
+	struct damage_rect rects[MAX_DAMAGE_RECTS];
+};
+
+struct display_framebuffer {
+	struct gbm_bo *bo;
+	uint32_t fb_id;
+	// output frames using it, queued or on screen
+	int refs;
+
+	// client buffer scanned out directly instead of composited output,
+	// buffer is NULL when client is gone
+	bool direct;
+	struct client *client;
+	struct client_buffer *buffer;
+};
+
+// damage of recent output frames, [0] is the latest one, used to repaint
+// back buffer according to its age
+#define MAX_BUFFER_AGE 4
+
+// frames queued for page flip, which is also limited by free buffers of
+// gbm surface when composited
+#define MAX_QUEUED_FRAMES 8
+
+struct output_frame;
+
+// a connector with its own crtc, scanout surface and page flip queue
+struct display_output {
+	drmModeConnectorPtr connector;
+	drmModeCrtcPtr crtc;
+	int crtc_index;
+	drmModeModeInfo mode;
+	// crtc is not driving the connector with mode yet, first commit
+	// sets it
+	bool modeset;
+	// original fb used for terminal, NULL if crtc was off
+	drmModeFBPtr orig_fb;
+
+	// outputs are laid out from left to right in global coordinates
+	// client windows use
+	uint32_t x;
+	uint32_t width;
+	uint32_t height;
+	// refresh period in nanoseconds
+	uint64_t refresh_ns;
+
+	struct plane planes[MAX_PLANES];
+	int num_planes;
+	uint32_t property_out_fence_ptr;
+	uint32_t property_mode_id;
+	uint32_t property_active;
+	uint32_t property_connector_crtc_id;
+	// 0 when crtc has no variable refresh rate support
+	uint32_t property_vrr_enabled;
+
+	// panel refreshes when a frame is committed instead of at a fixed
+	// rate, between its lowest rate and the one of mode
+	bool vrr;
+	// VRR_ENABLED is not set on crtc yet, first commit sets it
+	bool enable_vrr;
+	// new frames replace scanout at once with async flips, which may tear
+	bool tearing;
+
+	// layouts primary plane can scan out for composited output and clients
+	uint64_t output_modifiers[MAX_MODIFIERS];
+	int output_num_modifiers;
+	uint64_t client_modifiers[MAX_MODIFIERS];
+	int client_num_modifiers;
+
+	// composite target, all outputs share one GL context
+	struct gbm_surface *gs;
+	EGLSurface surface;
+
+	// screen damage not repainted yet, in addition to new client frames
+	struct region damage;
+	struct region damage_history[MAX_BUFFER_AGE];
+	// client buffer has been scanned out after last composite, so content
+	// of output buffers is outdated
+	bool stale;
+	// signaled when framebuffers replaced on screen are not scanned out
+	// any more, GPU must wait it before render to the released buffers
+	int scanout_release_fd;
+
+	// frame on screen, its framebuffers are released when next one is
+	// committed
+	struct output_frame *showing_frame;
+	// ring of frames waiting for page flip, only the head one may be
+	// committed
+	struct output_frame *queued_frames[MAX_QUEUED_FRAMES];
+	int queue_head;
+	int num_queued;
+	// head of queued frames is committed, waiting for its page flip
+	bool flip_pending;
+	// the commit is an async flip, which has no out fence
+	bool flip_async;
+
+	// vblank sequence and time of the last page flip or vblank event
+	uint64_t last_flip_sequence;
+	uint64_t last_flip_time;
+
+	int repaint_timer_fd;
+	bool repaint_scheduled;
+	// time before vblank to start composite in nanoseconds
+	uint64_t repaint_offset;
+	// page flips hit their expected vblank in a row
+	int repaint_hits;
+};
+
+#define MAX_OUTPUTS 4
+static struct display_output outputs[MAX_OUTPUTS];
+static int num_outputs = 0;
+
+// find crtc for connector not used by other outputs, prefer the one already
+// driving it, return its index in res or -1 if none, current tells whether
+// it's the one driving connector
+static int find_crtc(int fd, drmModeResPtr res, drmModeConnectorPtr connector,
+		     uint32_t used_crtcs, bool *current)
+{
+	*current = false;
+	if (connector->encoder_id) {
+		drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoder_id);
+		assert(encoder);
+		uint32_t crtc_id = encoder->crtc_id;
+		drmModeFreeEncoder(encoder);
+
+		for (int i = 0; i < res->count_crtcs; i++) {
+			if (crtc_id && res->crtcs[i] == crtc_id && !(used_crtcs & (1 << i))) {
+				*current = true;
+				return i;
+			}
+		}
+	}
+
+	for (int i = 0; i < connector->count_encoders; i++) {
+		drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoders[i]);
+		assert(encoder);
+		uint32_t possible = encoder->possible_crtcs & ~used_crtcs;
+		drmModeFreeEncoder(encoder);
+
+		for (int j = 0; j < res->count_crtcs; j++) {
+			if (possible & (1 << j))
+				return j;
+		}
+	}
+	return -1;
+}
+
+static void display_init(void)
+{
+	int fd = open("/dev/dri/card0", O_RDWR);
+	assert(fd >= 0);
+
+	drmModeResPtr res = drmModeGetResources(fd);
+	assert(res);
+
+	// bits of crtc index used by outputs found so far
+	uint32_t used_crtcs = 0;
+	uint32_t x = 0;
+	for (int i = 0; i < res->count_connectors && num_outputs < MAX_OUTPUTS; i++) {
+		drmModeConnectorPtr connector = drmModeGetConnector(fd, res->connectors[i]);
+		assert(connector);
+
+		// find connected connections
+		if (connector->connection != DRM_MODE_CONNECTED || !connector->count_modes) {
+			drmModeFreeConnector(connector);
+			continue;
+		}
+
+		bool current;
+		int crtc_index = find_crtc(fd, res, connector, used_crtcs, &current);
+		if (crtc_index < 0) {
+			fprintf(stderr, "no crtc for connector %u\n", connector->connector_id);
+			drmModeFreeConnector(connector);
+			continue;
+		}
+		used_crtcs |= 1 << crtc_index;
+
+		struct display_output *output = outputs + num_outputs++;
+		output->connector = connector;
+		output->crtc_index = crtc_index;
+		output->crtc = drmModeGetCrtc(fd, res->crtcs[crtc_index]);
+		assert(output->crtc);
+
+		if (current && output->crtc->mode_valid) {
+			// keep what terminal uses, restored when exit
+			output->mode = output->crtc->mode;
+			if (output->crtc->buffer_id)
+				output->orig_fb = drmModeGetFB(fd, output->crtc->buffer_id);
+		} else {
+			// preferred mode, or the first one if none is
+			output->mode = connector->modes[0];
+			for (int j = 0; j < connector->count_modes; j++) {
+				if (connector->modes[j].type & DRM_MODE_TYPE_PREFERRED) {
+					output->mode = connector->modes[j];
+					break;
+				}
+			}
+			output->modeset = true;
+		}
+
+		output->x = x;
+		output->width = output->mode.hdisplay;
+		output->height = output->mode.vdisplay;
+		x += output->width;
+
+		// mode clock is in kHz
+		output->refresh_ns = (uint64_t)output->mode.htotal * output->mode.vtotal *
+			1000000 / output->mode.clock;
+
+		output->scanout_release_fd = -1;
+
+		printf("output %d connector %u crtc %u %ux%u at %u%s\n", num_outputs - 1,
+		       connector->connector_id, output->crtc->crtc_id, output->width,
+		       output->height, output->x, output->modeset ? " modeset" : "");
+	}
+	assert(num_outputs);
+
+	drm_fd = fd;
+	state.fd = fd;
+
+	drmFree(res);
+}
+
+// all properties of a kms object, queried once when the object is first
+// looked up, object ids are unique among all types
+struct object_properties {
+	uint32_t object_id;
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr *properties;
+	struct object_properties *next;
+};
+
+static struct object_properties *property_cache = NULL;
+
+// one request is reused by all commits, rewound instead of reallocated, so
+// that commits don't allocate
+static drmModeAtomicReq *atomic_req;
+
+static struct object_properties *get_object_properties(uint32_t object_id,
+						       uint32_t object_type)
+{
+	struct object_properties *cache;
+	for (cache = property_cache; cache; cache = cache->next) {
+		if (cache->object_id == object_id)
+			return cache;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	assert(cache);
+	cache->object_id = object_id;
+	cache->props = drmModeObjectGetProperties(drm_fd, object_id, object_type);
+	assert(cache->props);
+
+	cache->properties = calloc(cache->props->count_props, sizeof(*cache->properties));
+	assert(cache->properties || !cache->props->count_props);
+	for (int i = 0; i < cache->props->count_props; i++) {
+		cache->properties[i] = drmModeGetProperty(drm_fd, cache->props->props[i]);
+		assert(cache->properties[i]);
+	}
+
+	cache->next = property_cache;
+	property_cache = cache;
+	return cache;
+}
+
+// find property of a kms object by name, return 0 if not exist, value is
+// the one when object is first looked up
+static uint32_t find_property(uint32_t object_id, uint32_t object_type,
+			      const char *name, uint64_t *value)
+{
+	struct object_properties *cache = get_object_properties(object_id, object_type);
+
+	for (int i = 0; i < cache->props->count_props; i++) {
+		if (!strcmp(cache->properties[i]->name, name)) {
+			if (value)
+				*value = cache->props->prop_values[i];
+			return cache->properties[i]->prop_id;
+		}
+	}
+	return 0;
+}
+
+static void plane_init(struct plane *plane, drmModePlanePtr p)
+{
+	plane->id = p->plane_id;
+	plane->num_formats = p->count_formats;
+	plane->formats = malloc(sizeof(uint32_t) * plane->num_formats);
+	assert(plane->formats);
+	memcpy(plane->formats, p->formats, sizeof(uint32_t) * plane->num_formats);
+
+	uint32_t id = plane->id;
+	uint32_t type = DRM_MODE_OBJECT_PLANE;
+	assert(find_property(id, type, "type", &plane->type));
+	// no zpos means planes stack in the order of their types
+	if (!find_property(id, type, "zpos", &plane->zpos))
+		plane->zpos = plane->type == DRM_PLANE_TYPE_PRIMARY ? 0 : 1;
+
+	assert((plane->fb_id = find_property(id, type, "FB_ID", NULL)));
+	assert((plane->crtc_id = find_property(id, type, "CRTC_ID", NULL)));
+	assert((plane->in_fence_fd = find_property(id, type, "IN_FENCE_FD", NULL)));
+	plane->fb_damage_clips = find_property(id, type, "FB_DAMAGE_CLIPS", NULL);
+	assert((plane->src_x = find_property(id, type, "SRC_X", NULL)));
+	assert((plane->src_y = find_property(id, type, "SRC_Y", NULL)));
+	assert((plane->src_w = find_property(id, type, "SRC_W", NULL)));
+	assert((plane->src_h = find_property(id, type, "SRC_H", NULL)));
+	assert((plane->crtc_x = find_property(id, type, "CRTC_X", NULL)));
+	assert((plane->crtc_y = find_property(id, type, "CRTC_Y", NULL)));
+	assert((plane->crtc_w = find_property(id, type, "CRTC_W", NULL)));
+	assert((plane->crtc_h = find_property(id, type, "CRTC_H", NULL)));
+}
+
+// modifiers of the format supported by plane according to its IN_FORMATS,
+// return number of them, 0 if plane doesn't tell
+static int get_plane_modifiers(struct plane *plane, uint32_t format,
+			       uint64_t *modifiers, int max)
+{
+	uint64_t blob_id;
+	if (!find_property(plane->id, DRM_MODE_OBJECT_PLANE, "IN_FORMATS", &blob_id))
+		return 0;
+
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(drm_fd, blob_id);
+	assert(blob);
+
+	struct drm_format_modifier_blob *data = blob->data;
+	uint32_t *formats = (uint32_t *)((char *)data + data->formats_offset);
+	struct drm_format_modifier *mods =
+		(struct drm_format_modifier *)((char *)data + data->modifiers_offset);
+
+	int num = 0;
+	for (uint32_t index = 0; index < data->count_formats; index++) {
+		if (formats[index] != format)
+			continue;
+
+		// each modifier has a bitmask of 64 formats starting at offset
+		for (uint32_t i = 0; i < data->count_modifiers && num < max; i++) {
+			struct drm_format_modifier *mod = mods + i;
+			if (index >= mod->offset && index < mod->offset + 64 &&
+			    mod->formats & (1ull << (index - mod->offset)))
+				modifiers[num++] = mod->modifier;
+		}
+		break;
+	}
+
+	drmModeFreePropertyBlob(blob);
+	return num;
+}
+
+// plane is used by an output already
+static bool plane_claimed(uint32_t id)
+{
+	for (int i = 0; i < num_outputs; i++) {
+		for (int j = 0; j < outputs[i].num_planes; j++) {
+			if (outputs[i].planes[j].id == id)
+				return true;
+		}
+	}
+	return false;
+}
+
+static void output_planes_init(struct display_output *output,
+			       drmModePlaneRes *plane_res)
+{
+	struct plane *planes = output->planes;
+	uint32_t crtc_id = output->crtc->crtc_id;
+
+	// primary plane used by target crtc first, then overlays can be
+	// used by it, cursor planes are left alone
+	output->num_planes = 1;
+	for (int i = 0; i < plane_res->count_planes; i++) {
+		drmModePlanePtr p = drmModeGetPlane(drm_fd, plane_res->planes[i]);
+		assert(p);
+
+		struct plane plane = {0};
+		if (p->possible_crtcs & (1 << output->crtc_index) &&
+		    !plane_claimed(p->plane_id))
+			plane_init(&plane, p);
+
+		printf("crtc %u plane %u type %llu zpos %llu formats %d\n", crtc_id,
+		       p->plane_id, (unsigned long long)plane.type,
+		       (unsigned long long)plane.zpos, plane.num_formats);
+
+		if (!plane.id)
+			;
+		else if (plane.type == DRM_PLANE_TYPE_PRIMARY && p->crtc_id == crtc_id) {
+			free(planes[0].formats);
+			planes[0] = plane;
+		} else if (plane.type == DRM_PLANE_TYPE_PRIMARY && !p->crtc_id &&
+			   !planes[0].id)
+			// crtc is off, take a free primary plane for it
+			planes[0] = plane;
+		else if (plane.type == DRM_PLANE_TYPE_OVERLAY && !p->crtc_id &&
+			 output->num_planes < MAX_PLANES)
+			planes[output->num_planes++] = plane;
+		else
+			free(plane.formats);
+
+		drmModeFreePlane(p);
+	}
+	assert(planes[0].id);
+
+	// sort overlays by zpos
+	for (int i = 2; i < output->num_planes; i++) {
+		for (int j = i; j > 1 && planes[j - 1].zpos > planes[j].zpos; j--) {
+			struct plane tmp = planes[j];
+			planes[j] = planes[j - 1];
+			planes[j - 1] = tmp;
+		}
+	}
+}
+
+static void atomic_mode_setting_init(void)
+{
+	// enable atomic mode setting, which also exposes all planes
+	assert(!drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1));
+
+	// page flip events tell which crtc flipped
+	uint64_t cap = 0;
+	assert(!drmGetCap(drm_fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &cap) && cap);
+
+	// async flips in atomic commits
+	uint64_t async_cap = 0;
+	if (config.tearing &&
+	    (drmGetCap(drm_fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &async_cap) || !async_cap))
+		printf("atomic async page flip not supported\n");
+
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(drm_fd);
+	assert(plane_res);
+
+	for (int i = 0; i < num_outputs; i++) {
+		struct display_output *output = outputs + i;
+		output_planes_init(output, plane_res);
+
+		output->output_num_modifiers =
+			get_plane_modifiers(output->planes, DRM_FORMAT_XRGB8888,
+					    output->output_modifiers, MAX_MODIFIERS);
+		output->client_num_modifiers =
+			get_plane_modifiers(output->planes, DRM_FORMAT_ARGB8888,
+					    output->client_modifiers, MAX_MODIFIERS);
+
+		uint32_t crtc_id = output->crtc->crtc_id;
+		uint32_t type = DRM_MODE_OBJECT_CRTC;
+		assert((output->property_out_fence_ptr =
+			find_property(crtc_id, type, "OUT_FENCE_PTR", NULL)));
+		assert((output->property_mode_id =
+			find_property(crtc_id, type, "MODE_ID", NULL)));
+		assert((output->property_active =
+			find_property(crtc_id, type, "ACTIVE", NULL)));
+		assert((output->property_connector_crtc_id =
+			find_property(output->connector->connector_id,
+				      DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", NULL)));
+
+		// both crtc and the panel behind connector need support
+		uint64_t vrr_capable = 0;
+		find_property(output->connector->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+			      "vrr_capable", &vrr_capable);
+		output->property_vrr_enabled =
+			find_property(crtc_id, type, "VRR_ENABLED", NULL);
+		output->vrr = config.vrr && vrr_capable && output->property_vrr_enabled;
+		output->enable_vrr = output->vrr;
+		output->tearing = config.tearing && async_cap;
+		if (config.vrr)
+			printf("output %d vrr %s\n", i, output->vrr ? "on" : "not supported");
+	}
+
+	drmModeFreePlaneResources(plane_res);
+
+	atomic_req = drmModeAtomicAlloc();
+	assert(atomic_req);
+}
+
+static const char vertex_shader[] =
+	"attribute vec3 positionIn;\n"
+	"attribute vec2 texcoordIn;\n"
+	"varying vec2 texcoord;\n"
+	"void main()\n"
+	"{\n"
+	"    gl_Position = vec4(positionIn, 1);\n"
+	"    texcoord = texcoordIn;\n"
+	"}\n";
+
+static const char fragment_shader[] =
+	"precision mediump float;\n"
+	"uniform sampler2D texMap;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"    gl_FragColor = texture2D(texMap, texcoord);\n"
+	"}\n";
+
+static const char external_fragment_shader[] =
+	"#extension GL_OES_EGL_image_external : require\n"
+	"precision mediump float;\n"
+	"uniform samplerExternalOES texMap;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"    gl_FragColor = texture2D(texMap, texcoord);\n"
+	"}\n";
+
+static int dispatch_fd;
+
+static void dispatch_add(int fd)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.fd = fd,
+	};
+	assert(!epoll_ctl(dispatch_fd, EPOLL_CTL_ADD, fd, &event));
+}
+
+static void dispatch_remove(int fd)
+{
+	assert(!epoll_ctl(dispatch_fd, EPOLL_CTL_DEL, fd, NULL));
+}
+
+struct client_buffer {
+	uint32_t id;
+	struct gbm_bo *bo;
+	EGLImageKHR image;
+	GLuint texid;
+	// GL_TEXTURE_2D or GL_TEXTURE_EXTERNAL_OES for YUV
+	GLenum target;
+	uint32_t width;
+	uint32_t height;
+
+	// index of the latest present of this buffer
+	uint64_t index;
+	// signaled when GPU is done with composite of each output sampling
+	// this buffer
+	int sample_fds[MAX_OUTPUTS];
+
+	// fences of clients relying on implicit sync are got from and given
+	// back to the dma-buf, implicit is set when latest present of the
+	// buffer carries no fence
+	int dmabuf_fd;
+	bool implicit;
+
+	// for scanout directly, NULL if buffer can't be scanned out
+	struct display_framebuffer *fb;
+};
+
+// frame whose render is not done yet, its fence fd is in dispatch list
+// until it signals
+struct fenced_frame {
+	struct present_buffer data;
+	int fd;
+	struct fenced_frame *next;
+};
+
+struct client {
+	int fd;
+	// registered buffers indexed by id, grows as client registers more
+	struct client_buffer **buffers;
+	uint32_t num_buffers;
+
+	// latest frame from client which has not been composited, its render
+	// is done
+	bool has_pending;
+	struct present_buffer pending;
+	// pending frame reach its target and can be composited by the output
+	// being repainted
+	bool pending_due;
+
+	// frames newer than pending in present order, the newest one whose
+	// fence signals becomes the pending frame and older ones are dropped
+	struct fenced_frame *fenced;
+
+	// timeline syncobjs shared by client, 0 when fences are passed by
+	// fds, release_point is the latest one used by present done
+	uint32_t acquire_syncobj;
+	uint32_t release_syncobj;
+	uint64_t release_point;
+
+	// client socket is in dispatch list
+	bool listening;
+	// client is gone or stops reading its socket, removed after events
+	// being handled
+	bool dead;
+
+	// frame composited to screen, also the window position
+	bool has_current;
+	struct present_buffer current;
+
+	// overlay plane of plane_output showing the client instead of
+	// composite, 0 if none
+	int plane;
+	struct display_output *plane_output;
+
+	struct client *next;
+};
+
+// clients in stacking order, last one is on top
+static struct client *clients = NULL;
+
+// binary syncobj moving fences between client timelines and sync_files,
+// created with the first timeline
+static uint32_t transfer_syncobj = 0;
+
+// client frame first shown by an output frame
+struct feedback {
+	struct client *client;
+	uint32_t id;
+	uint64_t index;
+	struct feedback *next;
+};
+
+static void feedback_remove_client(struct client *client);
+static void predict_flip(struct display_output *output, uint64_t *sequence,
+			 uint64_t *time);
+
+static void region_add(struct display_output *output, struct region *region,
+		       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	// clip to screen
+	int32_t x1 = x < 0 ? 0 : x;
+	int32_t y1 = y < 0 ? 0 : y;
+	int32_t x2 = x + width > (int32_t)output->width ? output->width : x + width;
+	int32_t y2 = y + height > (int32_t)output->height ? output->height : y + height;
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	if (region->num < MAX_DAMAGE_RECTS) {
+		struct damage_rect *rect = region->rects + region->num++;
+		rect->x = x1;
+		rect->y = y1;
+		rect->width = x2 - x1;
+		rect->height = y2 - y1;
+		return;
+	}
+
+	// too many rects, collapse all into their bounding box
+	for (int i = 0; i < region->num; i++) {
+		struct damage_rect *rect = region->rects + i;
+		if (rect->x < x1) x1 = rect->x;
+		if (rect->y < y1) y1 = rect->y;
+		if (rect->x + rect->width > x2) x2 = rect->x + rect->width;
+		if (rect->y + rect->height > y2) y2 = rect->y + rect->height;
+	}
+	region->num = 1;
+	region->rects[0].x = x1;
+	region->rects[0].y = y1;
+	region->rects[0].width = x2 - x1;
+	region->rects[0].height = y2 - y1;
+}
+
+static void region_union(struct display_output *output, struct region *region,
+			 struct region *other)
+{
+	for (int i = 0; i < other->num; i++) {
+		struct damage_rect *rect = other->rects + i;
+		region_add(output, region, rect->x, rect->y, rect->width, rect->height);
+	}
+}
+
+// whole output needs repaint
+static void damage_output(struct display_output *output)
+{
+	output->damage.num = 0;
+	region_add(output, &output->damage, 0, 0, output->width, output->height);
+}
+
+static bool has_buffer_age = false;
+static bool has_partial_update = false;
+static bool has_swap_with_damage = false;
+
+static void damage_init(void)
+{
+	has_buffer_age = epoxy_has_egl_extension(state.display, "EGL_EXT_buffer_age");
+	has_partial_update = epoxy_has_egl_extension(state.display, "EGL_KHR_partial_update");
+	has_swap_with_damage =
+		epoxy_has_egl_extension(state.display, "EGL_KHR_swap_buffers_with_damage");
+}
+
+// add area of client frame in global coordinates to damage of output
+static void damage_area(struct display_output *output, struct present_buffer *data,
+			int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	region_add(output, &output->damage, (int32_t)data->x - (int32_t)output->x + x,
+		   data->y + y, width, height);
+}
+
+static void damage_output_window(struct display_output *output,
+				 struct client *client, struct present_buffer *data)
+{
+	struct client_buffer *buffer = client->buffers[data->id];
+	damage_area(output, data, 0, 0, buffer->width, buffer->height);
+}
+
+// window may span several outputs
+static void damage_window(struct client *client, struct present_buffer *data)
+{
+	for (int i = 0; i < num_outputs; i++)
+		damage_output_window(outputs + i, client, data);
+}
+
+// add damage of new client frame to screen damage of output
+static void damage_client(struct display_output *output, struct client *client)
+{
+	struct present_buffer *data = &client->pending;
+
+	// window moved or first show, both old and new place need repaint
+	if (!client->has_current || client->current.x != data->x ||
+	    client->current.y != data->y || !data->num_damage) {
+		if (client->has_current)
+			damage_output_window(output, client, &client->current);
+		damage_output_window(output, client, data);
+		return;
+	}
+
+	for (int i = 0; i < data->num_damage && i < MAX_DAMAGE_RECTS; i++) {
+		struct damage_rect *rect = data->damage + i;
+		damage_area(output, data, rect->x, rect->y, rect->width, rect->height);
+	}
+}
+
+// convert to EGL/GL rects with origin at bottom left
+static int region_to_egl(struct display_output *output, struct region *region,
+			 EGLint *rects)
+{
+	for (int i = 0; i < region->num; i++) {
+		struct damage_rect *rect = region->rects + i;
+		rects[i * 4] = rect->x;
+		rects[i * 4 + 1] = output->height - rect->y - rect->height;
+		rects[i * 4 + 2] = rect->width;
+		rects[i * 4 + 3] = rect->height;
+	}
+	return region->num;
+}
+
+// output containing top left of the window, client frames are shown at its
+// vblanks, the first output when window is out of all of them
+static struct display_output *client_output(struct client *client)
+{
+	struct present_buffer *data = client->has_pending ?
+		&client->pending : &client->current;
+
+	for (int i = 0; i < num_outputs; i++) {
+		struct display_output *output = outputs + i;
+		if (data->x >= output->x && data->x < output->x + output->width &&
+		    data->y < output->height)
+			return output;
+	}
+	return outputs;
+}
+
+static bool window_on_output(struct client *client, struct present_buffer *data,
+			     struct display_output *output)
+{
+	struct client_buffer *buffer = client->buffers[data->id];
+	return data->x < output->x + output->width &&
+		data->x + buffer->width > output->x && data->y < output->height;
+}
+
+static bool window_inside_output(struct client *client, struct present_buffer *data,
+				 struct display_output *output)
+{
+	struct client_buffer *buffer = client->buffers[data->id];
+	return data->x >= output->x &&
+		data->x + buffer->width <= output->x + output->width &&
+		data->y + buffer->height <= output->height;
+}
+
+// overlay plane of output showing client, 0 if none
+static int client_plane(struct client *client, struct display_output *output)
+{
+	return client->plane_output == output ? client->plane : 0;
+}
+
+static void client_send(struct client *client, struct message *msg,
+			int *fds, int num_fd)
+{
+	// socket is non-blocking, a client not reading it must not stall
+	// the server and others, it's dropped when the socket is full, a
+	// partial message breaks the stream as well
+	if (client->dead)
+		return;
+	if (sock_fd_write(client->fd, msg, sizeof(*msg), num_fd ? fds : NULL,
+			  num_fd) != sizeof(*msg))
+		client->dead = true;
+}
+
+static struct display_framebuffer *create_client_fb(struct client *client,
+						     struct client_buffer *buffer,
+						     uint32_t fb_id);
+
+static bool plane_support_format(struct plane *plane, uint32_t format)
+{
+	for (int i = 0; i < plane->num_formats; i++) {
+		if (plane->formats[i] == format)
+			return true;
+	}
+	return false;
+}
+
+// add kms framebuffer of bo, with its modifier when the layout is explicit
+static int add_framebuffer(struct gbm_bo *bo, uint32_t format, uint32_t *fb_id)
+{
+	uint32_t handles[4] = {0};
+	uint32_t pitches[4] = {0};
+	uint32_t offsets[4] = {0};
+	uint64_t modifiers[4] = {0};
+	uint64_t modifier = gbm_bo_get_modifier(bo);
+
+	// compressed layouts have aux planes
+	for (int i = 0; i < gbm_bo_get_plane_count(bo); i++) {
+		handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+		pitches[i] = gbm_bo_get_stride_for_plane(bo, i);
+		offsets[i] = gbm_bo_get_offset(bo, i);
+		modifiers[i] = modifier;
+	}
+
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		return drmModeAddFB2(drm_fd, gbm_bo_get_width(bo), gbm_bo_get_height(bo),
+				     format, handles, pitches, offsets, fb_id, 0);
+
+	return drmModeAddFB2WithModifiers(drm_fd, gbm_bo_get_width(bo),
+					  gbm_bo_get_height(bo), format, handles,
+					  pitches, offsets, modifiers, fb_id,
+					  DRM_MODE_FB_MODIFIERS);
+}
+
+// composite draws client buffers without blending onto opaque output, so
+// they are scanned out ignoring alpha as well, or a window would change
+// when it moves between overlay and composite
+static uint32_t scanout_format(struct gbm_bo *bo)
+{
+	uint32_t format = gbm_bo_get_format(bo);
+	switch (format) {
+	case DRM_FORMAT_ARGB8888:
+		return DRM_FORMAT_XRGB8888;
+	case DRM_FORMAT_ABGR8888:
+		return DRM_FORMAT_XBGR8888;
+	case DRM_FORMAT_RGBA8888:
+		return DRM_FORMAT_RGBX8888;
+	case DRM_FORMAT_BGRA8888:
+		return DRM_FORMAT_BGRX8888;
+	case DRM_FORMAT_ARGB2101010:
+		return DRM_FORMAT_XRGB2101010;
+	case DRM_FORMAT_ABGR2101010:
+		return DRM_FORMAT_XBGR2101010;
+	default:
+		return format;
+	}
+}
+
+// plane of any output can show it
+static bool any_plane_support_format(uint32_t format)
+{
+	for (int i = 0; i < num_outputs; i++) {
+		for (int j = 0; j < outputs[i].num_planes; j++) {
+			if (plane_support_format(outputs[i].planes + j, format))
+				return true;
+		}
+	}
+	return false;
+}
+
+static void add_scanout_fb(struct client *client, struct client_buffer *buffer)
+{
+	struct gbm_bo *bo = buffer->bo;
+	uint32_t format = scanout_format(bo);
+
+	if (!any_plane_support_format(format))
+		return;
+
+	// driver reject buffers with layout the plane can't scan out
+	uint32_t fb_id;
+	if (add_framebuffer(bo, format, &fb_id))
+		return;
+
+	buffer->fb = create_client_fb(client, buffer, fb_id);
+}
+
+static bool has_dmabuf_import = false;
+static bool has_dmabuf_modifiers = false;
+// YUV buffers are sampled as external texture, which driver converts
+static GLuint external_program = 0;
+
+static void import_init(void)
+{
+	has_dmabuf_import =
+		epoxy_has_egl_extension(state.display, "EGL_EXT_image_dma_buf_import");
+	has_dmabuf_modifiers =
+		epoxy_has_egl_extension(state.display, "EGL_EXT_image_dma_buf_import_modifiers");
+}
+
+static bool format_is_yuv(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV21:
+	case DRM_FORMAT_NV16:
+	case DRM_FORMAT_P010:
+	case DRM_FORMAT_YUV420:
+	case DRM_FORMAT_YVU420:
+	case DRM_FORMAT_YUYV:
+	case DRM_FORMAT_UYVY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// import all planes of client buffer as one EGLImage
+static EGLImageKHR import_dmabuf(struct register_buffer *data, int *fds)
+{
+	static const EGLint plane_attribs[MAX_BUFFER_PLANES][5] = {
+		{
+			EGL_DMA_BUF_PLANE0_FD_EXT,
+			EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE0_PITCH_EXT,
+			EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+		},
+		{
+			EGL_DMA_BUF_PLANE1_FD_EXT,
+			EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE1_PITCH_EXT,
+			EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+		},
+		{
+			EGL_DMA_BUF_PLANE2_FD_EXT,
+			EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE2_PITCH_EXT,
+			EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+		},
+		{
+			EGL_DMA_BUF_PLANE3_FD_EXT,
+			EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE3_PITCH_EXT,
+			EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT,
+		},
+	};
+
+	EGLint attribs[6 + MAX_BUFFER_PLANES * 10 + 1];
+	int n = 0;
+	attribs[n++] = EGL_WIDTH;
+	attribs[n++] = data->width;
+	attribs[n++] = EGL_HEIGHT;
+	attribs[n++] = data->height;
+	attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[n++] = data->format;
+
+	bool modifier = data->modifier != DRM_FORMAT_MOD_INVALID;
+	// explicit layout can't be passed to EGL without modifier support
+	if (modifier && !has_dmabuf_modifiers)
+		return EGL_NO_IMAGE_KHR;
+	for (int i = 0; i < data->num_planes; i++) {
+		attribs[n++] = plane_attribs[i][0];
+		attribs[n++] = fds[i];
+		attribs[n++] = plane_attribs[i][1];
+		attribs[n++] = data->offsets[i];
+		attribs[n++] = plane_attribs[i][2];
+		attribs[n++] = data->strides[i];
+		if (modifier) {
+			attribs[n++] = plane_attribs[i][3];
+			attribs[n++] = data->modifier & 0xffffffff;
+			attribs[n++] = plane_attribs[i][4];
+			attribs[n++] = data->modifier >> 32;
+		}
+	}
+	attribs[n++] = EGL_NONE;
+
+	return eglCreateImageKHR(state.display, EGL_NO_CONTEXT,
+				 EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+}
+
+// planes of buffer are either all in one dma-buf or one dma-buf each
+// fence of writes to dma-buf so far, -1 when kernel can't export it
+static int dmabuf_export_fence(int dmabuf_fd)
+{
+	struct dma_buf_export_sync_file data = {
+		.flags = DMA_BUF_SYNC_READ,
+		.fd = -1,
+	};
+	if (ioctl(dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &data))
+		return -1;
+	return data.fd;
+}
+
+// later writes to dma-buf wait for reads of fd, which is not consumed,
+// old kernel leaves it to driver tracking the reads by itself
+static void dmabuf_import_fence(int dmabuf_fd, int fd)
+{
+	struct dma_buf_import_sync_file data = {
+		.flags = DMA_BUF_SYNC_READ,
+		.fd = fd,
+	};
+	ioctl(dmabuf_fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &data);
+}
+
+// return false when buffer can't be imported, fds are left to caller then,
+// otherwise they are taken
+static bool register_buffer(struct client *client, struct register_buffer *data,
+			    int *buffer_fds, int num_fd)
+{
+	if (!data->num_planes || data->num_planes > MAX_BUFFER_PLANES ||
+	    (num_fd != 1 && num_fd != data->num_planes))
+		return false;
+
+	struct client_buffer *buffer = calloc(1, sizeof(*buffer));
+	assert(buffer);
+
+	int fds[MAX_BUFFER_PLANES];
+	for (int i = 0; i < data->num_planes; i++)
+		fds[i] = buffer_fds[num_fd == 1 ? 0 : i];
+
+	// implicit layout of single plane can only be imported by legacy fd
+	// import, others need modifier import
+	uint32_t type;
+	void *import_data;
+	struct gbm_import_fd_data fd_data = {
+		.fd = fds[0],
+		.width = data->width,
+		.height = data->height,
+		.stride = data->strides[0],
+		.format = data->format,
+	};
+	struct gbm_import_fd_modifier_data modifier_data = {
+		.width = data->width,
+		.height = data->height,
+		.format = data->format,
+		.num_fds = data->num_planes,
+		.modifier = data->modifier,
+	};
+	for (int i = 0; i < data->num_planes; i++) {
+		modifier_data.fds[i] = fds[i];
+		modifier_data.strides[i] = data->strides[i];
+		modifier_data.offsets[i] = data->offsets[i];
+	}
+	if (data->modifier == DRM_FORMAT_MOD_INVALID && data->num_planes == 1) {
+		type = GBM_BO_IMPORT_FD;
+		import_data = &fd_data;
+	} else {
+		type = GBM_BO_IMPORT_FD_MODIFIER;
+		import_data = &modifier_data;
+	}
+
+	// try scanout usage first, so that the buffer can be put on plane
+	// directly when it covers the whole screen
+	bool scanout = true;
+	buffer->bo = gbm_bo_import(
+		state.gbm, type, import_data,
+		GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+	if (!buffer->bo) {
+		scanout = false;
+		buffer->bo = gbm_bo_import(
+			state.gbm, type, import_data, GBM_BO_USE_RENDERING);
+	}
+	if (!buffer->bo) {
+		free(buffer);
+		return false;
+	}
+
+	// YUV can only be sampled as external texture, client is dropped
+	// when it's not supported
+	bool yuv = format_is_yuv(data->format);
+	if (yuv && !(has_dmabuf_import && external_program)) {
+		gbm_bo_destroy(buffer->bo);
+		free(buffer);
+		return false;
+	}
+	buffer->target = yuv ? GL_TEXTURE_EXTERNAL_OES : GL_TEXTURE_2D;
+
+	if (has_dmabuf_import)
+		buffer->image = import_dmabuf(data, fds);
+	else {
+		epoxy_has_egl_extension(state.display, "EGL_KHR_image_pixmap");
+
+		buffer->image = eglCreateImageKHR(
+			state.display, state.context,
+			EGL_NATIVE_PIXMAP_KHR, buffer->bo, NULL);
+	}
+	if (buffer->image == EGL_NO_IMAGE_KHR) {
+		gbm_bo_destroy(buffer->bo);
+		free(buffer);
+		return false;
+	}
+
+	// buffer id is its index in the table
+	uint32_t id = client->num_buffers++;
+	client->buffers = realloc(client->buffers,
+				  sizeof(*client->buffers) * client->num_buffers);
+	assert(client->buffers);
+	buffer->id = id;
+	client->buffers[id] = buffer;
+
+	// close after usage, both gbm bo and EGLImage hold their own reference,
+	// keep one for fences of implicit sync
+	buffer->dmabuf_fd = buffer_fds[0];
+	for (int i = 1; i < num_fd; i++)
+		close(buffer_fds[i]);
+
+	epoxy_has_gl_extension("GL_OES_EGL_image");
+
+	// texture keeps sampling the client buffer, so it lives as long
+	// as the buffer is registered
+	glGenTextures(1, &buffer->texid);
+	glBindTexture(buffer->target, buffer->texid);
+	glTexParameteri(buffer->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(buffer->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glEGLImageTargetTexture2DOES(buffer->target, buffer->image);
+
+	buffer->width = data->width;
+	buffer->height = data->height;
+	for (int i = 0; i < MAX_OUTPUTS; i++)
+		buffer->sample_fds[i] = -1;
+	buffer->fb = NULL;
+
+	if (scanout)
+		add_scanout_fb(client, buffer);
+
+	// tell client the id of this buffer
+	struct message reply = {
+		.type = MESSAGE_BUFFER_REGISTERED,
+		.buffer_registered = {
+			.id = id,
+		},
+	};
+	client_send(client, &reply, NULL, 0);
+	return true;
+}
+
+static void destroy_client_fb(struct display_framebuffer *fb);
+
+static void destroy_buffer(struct client_buffer *buffer)
+{
+	// fb on screen is destroyed when it's replaced
+	if (buffer->fb)
+		destroy_client_fb(buffer->fb);
+	for (int i = 0; i < num_outputs; i++) {
+		if (buffer->sample_fds[i] >= 0)
+			close(buffer->sample_fds[i]);
+	}
+	close(buffer->dmabuf_fd);
+
+	glDeleteTextures(1, &buffer->texid);
+	eglDestroyImageKHR(state.display, buffer->image);
+	gbm_bo_destroy(buffer->bo);
+	free(buffer);
+}
+
+static void client_listen(struct client *client, bool listen)
+{
+	if (client->listening == listen)
+		return;
+
+	if (listen)
+		dispatch_add(client->fd);
+	else
+		dispatch_remove(client->fd);
+	client->listening = listen;
+}
+
+static void client_accept(int listen_fd)
+{
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		perror("accept");
+		return;
+	}
+
+	assert(!fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+
+	struct client *client = calloc(1, sizeof(*client));
+	assert(client);
+	client->fd = fd;
+
+	// put new client on top
+	struct client **tail = &clients;
+	while (*tail) tail = &(*tail)->next;
+	*tail = client;
+
+	client_listen(client, true);
+
+	// clients are placed on the first output
+	struct display_output *output = outputs;
+	struct message msg = {
+		.type = MESSAGE_OUTPUT,
+		.output = {
+			.width = output->width,
+			.height = output->height,
+			.refresh = output->refresh_ns,
+			.num_modifiers = output->client_num_modifiers,
+		},
+	};
+	memcpy(msg.output.modifiers, output->client_modifiers,
+	       sizeof(*output->client_modifiers) * output->client_num_modifiers);
+	client_send(client, &msg, NULL, 0);
+}
+
+static void client_remove(struct client *client)
+{
+	struct client **prev = &clients;
+	while (*prev != client) prev = &(*prev)->next;
+	*prev = client->next;
+
+	client_listen(client, false);
+	close(client->fd);
+
+	while (client->fenced) {
+		struct fenced_frame *frame = client->fenced;
+		client->fenced = frame->next;
+		dispatch_remove(frame->fd);
+		close(frame->fd);
+		free(frame);
+	}
+
+	feedback_remove_client(client);
+
+	// window disappear from screen
+	if (client->has_current)
+		damage_window(client, &client->current);
+
+	for (uint32_t i = 0; i < client->num_buffers; i++)
+		destroy_buffer(client->buffers[i]);
+	free(client->buffers);
+
+	if (client->acquire_syncobj) {
+		drmSyncobjDestroy(drm_fd, client->acquire_syncobj);
+		drmSyncobjDestroy(drm_fd, client->release_syncobj);
+	}
+
+	free(client);
+}
+
+static struct client *client_find(int fd)
+{
+	for (struct client *client = clients; client; client = client->next) {
+		if (client->fd == fd)
+			return client;
+	}
+	return NULL;
+}
+
+// fenced frame waiting for fd and its client
+static struct fenced_frame *fence_find(int fd, struct client **client)
+{
+	for (*client = clients; *client; *client = (*client)->next) {
+		struct fenced_frame *frame;
+		for (frame = (*client)->fenced; frame; frame = frame->next) {
+			if (frame->fd == fd)
+				return frame;
+		}
+	}
+	return NULL;
+}
+
+static void draw_client(struct display_output *output, struct client *client,
+			struct present_buffer *data)
+{
+	assert(data->id < client->num_buffers);
+	struct client_buffer *buffer = client->buffers[data->id];
+	assert(buffer->bo);
+
+	GLuint program = buffer->target == GL_TEXTURE_EXTERNAL_OES ?
+		external_program : state.program;
+	glUseProgram(program);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(buffer->target, buffer->texid);
+
+	// window position relative to output
+	GLfloat x = -1.0 + ((int32_t)data->x - (int32_t)output->x) * 2.0 / output->width;
+	GLfloat y = 1.0 - data->y * 2.0 / output->height;
+	GLfloat w = x + buffer->width * 2.0 / output->width;
+	GLfloat h = y - buffer->height * 2.0 / output->height;
+
+	GLfloat vertex[] = {
+		x, h, 0,
+		x, y, 0,
+		w, y, 0,
+		w, h, 0,
+	};
+
+	GLfloat texcoord[] = {
+		0, 1,
+		0, 0,
+		1, 0,
+		1, 1,
+	};
+
+	GLushort index[] = {
+		0, 1, 3,
+		1, 2, 3,
+	};
+
+	GLint pos = glGetAttribLocation(program, "positionIn");
+        glEnableVertexAttribArray(pos);
+	glVertexAttribPointer(pos, 3, GL_FLOAT, 0, 0, vertex);
+
+	GLint tex = glGetAttribLocation(program, "texcoordIn");
+        glEnableVertexAttribArray(tex);
+	glVertexAttribPointer(tex, 2, GL_FLOAT, 0, 0, texcoord);
+
+	GLint texMap = glGetUniformLocation(program, "texMap");
+	glUniform1i(texMap, 0); // GL_TEXTURE0
+
+	glDrawElements(GL_TRIANGLES, sizeof(index)/sizeof(GLushort), GL_UNSIGNED_SHORT, index);
+}
+
+// whether pending frame should be shown by the output frame composited now,
+// which will be shown at the predicted vblank
+static bool frame_due(struct present_buffer *data, uint64_t sequence,
+		      uint64_t time, uint64_t period)
+{
+	if (data->target_sequence && sequence < data->target_sequence)
+		return false;
+
+	// show at the vblank closest to target time
+	if (data->target_time && time + period / 2 < data->target_time)
+		return false;
+
+	return true;
+}
+
+// update pending frames which can be composited to output now, return if
+// there is one, only frames of windows on output are
+static bool update_pending_due(struct display_output *output)
+{
+	uint64_t sequence, time;
+	predict_flip(output, &sequence, &time);
+
+	bool due = false;
+	for (struct client *client = clients; client; client = client->next) {
+		client->pending_due = client->has_pending &&
+			client_output(client) == output &&
+			frame_due(&client->pending, sequence, time, output->refresh_ns);
+		due |= client->pending_due;
+	}
+	return due;
+}
+
+static bool need_composite(struct display_output *output)
+{
+	if (update_pending_due(output))
+		return true;
+
+	return output->damage.num;
+}
+
+// some frames on output are held until their target vblank
+static bool has_held_frame(struct display_output *output)
+{
+	for (struct client *client = clients; client; client = client->next) {
+		if (client->has_pending && !client->pending_due &&
+		    client_output(client) == output)
+			return true;
+	}
+	return false;
+}
+
+// inform client the buffer has been consumed, client waits for the fences
+// before reuse it
+static void send_done(struct client *client, uint32_t id, uint64_t index,
+		      int *fds, int num_fd)
+{
+	struct message done = {
+		.type = MESSAGE_PRESENT_DONE,
+		.present_done = {
+			.id = id,
+			.index = index,
+		},
+	};
+
+	// fence goes to the next release point instead of the socket
+	if (client->release_syncobj) {
+		done.present_done.release_point = ++client->release_point;
+		syncobj_import(drm_fd, transfer_syncobj, client->release_syncobj,
+			       client->release_point, num_fd ? dup(fds[0]) : -1);
+		num_fd = 0;
+	}
+
+	client_send(client, &done, fds, num_fd);
+}
+
+// buffer is free when it's neither client's current frame nor on screen,
+// release_fd signals when display is done with it
+static void try_release_buffer(struct client *client, struct client_buffer *buffer,
+			       int release_fd)
+{
+	if (buffer->fb && buffer->fb->refs)
+		return;
+	if (client->has_current && client->buffers[client->current.id] == buffer)
+		return;
+
+	// client waits one fence for all users of the buffer
+	int fd = release_fd >= 0 ? dup(release_fd) : -1;
+	for (int i = 0; i < num_outputs; i++) {
+		fd = merge_fence(fd, buffer->sample_fds[i]);
+		buffer->sample_fds[i] = -1;
+	}
+
+	// next render of implicit sync client waits in kernel instead
+	if (buffer->implicit && fd >= 0) {
+		dmabuf_import_fence(buffer->dmabuf_fd, fd);
+		close(fd);
+		fd = -1;
+	}
+	send_done(client, buffer->id, buffer->index, &fd, fd >= 0);
+	if (fd >= 0)
+		close(fd);
+}
+
+// composite of output samples buffer, fd signals when it's done
+static void buffer_sampled(struct display_output *output,
+			   struct client_buffer *buffer, int fd)
+{
+	int *sample_fd = buffer->sample_fds + (output - outputs);
+	if (*sample_fd >= 0)
+		close(*sample_fd);
+	*sample_fd = fd >= 0 ? dup(fd) : -1;
+}
+
+// pending frame is shown by output, replaced current buffer is released
+static void update_current(struct display_output *output, struct client *client,
+			   struct feedback **feedbacks)
+{
+	// feedback client when this output frame is shown
+	struct feedback *feedback = malloc(sizeof(*feedback));
+	assert(feedback);
+	feedback->client = client;
+	feedback->id = client->pending.id;
+	feedback->index = client->pending.index;
+	feedback->next = *feedbacks;
+	*feedbacks = feedback;
+
+	// other outputs the window spans show the new frame in their next
+	// composite
+	for (int i = 0; i < num_outputs; i++) {
+		if (outputs + i != output)
+			damage_client(outputs + i, client);
+	}
+
+	struct client_buffer *old = client->has_current ?
+		client->buffers[client->current.id] : NULL;
+
+	client->current = client->pending;
+	client->has_current = true;
+	client->has_pending = false;
+	client->pending_due = false;
+	client->buffers[client->current.id]->index = client->current.index;
+
+	if (old && old != client->buffers[client->current.id])
+		try_release_buffer(client, old, -1);
+
+	// ready for next frame of this client
+	client_listen(client, true);
+}
+
+// frame of client shown by the output frame composited now, NULL if none
+static struct present_buffer *shown_frame(struct client *client)
+{
+	if (client->pending_due)
+		return &client->pending;
+	if (client->has_current)
+		return &client->current;
+	return NULL;
+}
+
+// composite current frame of all clients on output into one output frame,
+// only repaint the damaged area, frame_damage is the area changed since
+// previous output frame, feedbacks are the new client frames in it
+// clients on overlay planes are left out, pending frames due are the ones
+// updated by need_composite()
+static int composite(struct display_output *output, struct region *frame_damage,
+		     struct feedback **feedbacks)
+{
+	for (struct client *client = clients; client; client = client->next) {
+		if (!client_plane(client, output) && client->pending_due)
+			damage_client(output, client);
+	}
+
+	// all outputs share the context, each renders to its own surface
+	assert(eglMakeCurrent(state.display, output->surface, output->surface,
+			      state.context) == EGL_TRUE);
+	glViewport(0, 0, output->width, output->height);
+
+	// back buffer content is from age frames before, so damage of
+	// frames after it also need repaint, age 0 means unknown content
+	EGLint age = 0;
+	if (has_buffer_age)
+		eglQuerySurface(state.display, output->surface, EGL_BUFFER_AGE_EXT, &age);
+
+	// plane showed client buffer, nothing on screen can be kept
+	if (output->stale) {
+		damage_output(output);
+		output->stale = false;
+	}
+
+	struct region repaint = output->damage;
+	if (age > 0 && age <= MAX_BUFFER_AGE) {
+		for (int i = 0; i < age - 1; i++)
+			region_union(output, &repaint, output->damage_history + i);
+	} else {
+		repaint.num = 0;
+		region_add(output, &repaint, 0, 0, output->width, output->height);
+	}
+
+	for (int i = MAX_BUFFER_AGE - 1; i > 0; i--)
+		output->damage_history[i] = output->damage_history[i - 1];
+	output->damage_history[0] = output->damage;
+
+	EGLint rects[MAX_DAMAGE_RECTS * 4];
+	int num_rects = region_to_egl(output, &repaint, rects);
+
+	// tell driver content outside repaint area can be kept
+	if (has_partial_update)
+		eglSetDamageRegionKHR(state.display, output->surface, rects, num_rects);
+
+	// back buffer may be still on screen until its replacing commit done
+	if (output->scanout_release_fd >= 0) {
+		wait_fence(state.display, output->scanout_release_fd);
+		close(output->scanout_release_fd);
+		output->scanout_release_fd = -1;
+	}
+
+	glEnable(GL_SCISSOR_TEST);
+	for (int i = 0; i < num_rects; i++) {
+		EGLint *rect = rects + i * 4;
+		glScissor(rect[0], rect[1], rect[2], rect[3]);
+
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		for (struct client *client = clients; client; client = client->next) {
+			struct present_buffer *data = shown_frame(client);
+			if (client_plane(client, output) || !data ||
+			    !window_on_output(client, data, output))
+				continue;
+			draw_client(output, client, data);
+		}
+	}
+	glDisable(GL_SCISSOR_TEST);
+
+	// after composite is done, this fence will be signaled
+	int signal_fd = get_fence(state.display);
+
+	// output frame should be ready for the vblank it's expected at
+	uint64_t flip_sequence, flip_time;
+	predict_flip(output, &flip_sequence, &flip_time);
+	if (signal_fd >= 0 && flip_time != UINT64_MAX)
+		set_fence_deadline(signal_fd, flip_time);
+
+	// swap back buffer to front
+	if (has_swap_with_damage) {
+		num_rects = region_to_egl(output, &output->damage, rects);
+		eglSwapBuffersWithDamageKHR(state.display, output->surface,
+					    rects, num_rects);
+	} else
+		eglSwapBuffers(state.display, output->surface);
+
+	for (struct client *client = clients; client; client = client->next) {
+		struct present_buffer *data = shown_frame(client);
+		if (client_plane(client, output) || !data)
+			continue;
+		// due frame not on its output is out of all outputs, it's
+		// consumed without being drawn, so it isn't due forever
+		if (!window_on_output(client, data, output)) {
+			if (client->pending_due)
+				update_current(output, client, feedbacks);
+			continue;
+		}
+		buffer_sampled(output, client->buffers[data->id], signal_fd);
+		if (client->pending_due)
+			update_current(output, client, feedbacks);
+	}
+
+	*frame_damage = output->damage;
+	output->damage.num = 0;
+	return signal_fd;
+}
+
+// content of a plane in an output frame, plane is disabled without fb
+struct plane_state {
+	struct display_framebuffer *fb;
+	int32_t x, y;
+	uint32_t width, height;
+	// signaled when fb content is ready
+	int wait_fd;
+	// changed area since previous output frame, none means whole plane
+	struct region damage;
+};
+
+// all planes of an output shown at one vblank
+struct output_frame {
+	struct plane_state planes[MAX_PLANES];
+	struct feedback *feedbacks;
+	// vblank sequence this frame is expected to be shown at
+	uint64_t expected_sequence;
+};
+
+static struct display_framebuffer *create_client_fb(struct client *client,
+						     struct client_buffer *buffer,
+						     uint32_t fb_id)
+{
+	struct display_framebuffer *fb = calloc(1, sizeof(*fb));
+	assert(fb);
+	fb->bo = buffer->bo;
+	fb->fb_id = fb_id;
+	fb->direct = true;
+	fb->client = client;
+	fb->buffer = buffer;
+	return fb;
+}
+
+static void destroy_client_fb(struct display_framebuffer *fb)
+{
+	// removing fb on screen disables the plane, leave it to be
+	// destroyed when it's replaced
+	if (fb->refs) {
+		fb->client = NULL;
+		fb->buffer = NULL;
+		return;
+	}
+
+	drmModeRmFB(drm_fd, fb->fb_id);
+	free(fb);
+}
+
+// output frame using fb is replaced on screen by a commit, release_fd
+// signals when the commit is done, -1 if the frame has never been on screen
+static void release_framebuffer(struct display_output *output,
+				struct display_framebuffer *fb, int release_fd)
+{
+	// still used by a later frame
+	if (--fb->refs)
+		return;
+
+	if (fb->direct) {
+		// client is gone
+		if (!fb->buffer) {
+			drmModeRmFB(drm_fd, fb->fb_id);
+			free(fb);
+			return;
+		}
+
+		try_release_buffer(fb->client, fb->buffer, release_fd);
+		return;
+	}
+
+	gbm_surface_release_buffer(output->gs, fb->bo);
+
+	// newer commit is done after older ones, only keep the latest
+	if (release_fd >= 0) {
+		if (output->scanout_release_fd >= 0)
+			close(output->scanout_release_fd);
+		output->scanout_release_fd = dup(release_fd);
+	}
+}
+
+static void release_frame(struct display_output *output,
+			  struct output_frame *frame, int release_fd)
+{
+	for (int i = 0; i < output->num_planes; i++) {
+		struct plane_state *ps = frame->planes + i;
+		if (ps->wait_fd >= 0) {
+			close(ps->wait_fd);
+			ps->wait_fd = -1;
+		}
+		if (ps->fb)
+			release_framebuffer(output, ps->fb, release_fd);
+	}
+}
+
+static struct output_frame *create_frame(struct display_output *output)
+{
+	struct output_frame *frame = calloc(1, sizeof(*frame));
+	assert(frame);
+	for (int i = 0; i < output->num_planes; i++)
+		frame->planes[i].wait_fd = -1;
+	return frame;
+}
+
+// slot of the ith queued frame from head in the ring
+static struct output_frame **queued_frame(struct display_output *output, int i)
+{
+	return output->queued_frames + (output->queue_head + i) % MAX_QUEUED_FRAMES;
+}
+
+// latest queued frame, or the one on screen when none is queued
+static struct output_frame *latest_frame(struct display_output *output)
+{
+	if (!output->num_queued)
+		return output->showing_frame;
+	return *queued_frame(output, output->num_queued - 1);
+}
+
+static void set_plane_state(struct plane_state *ps, struct display_framebuffer *fb,
+			    int32_t x, int32_t y, uint32_t width, uint32_t height)
+{
+	ps->fb = fb;
+	ps->x = x;
+	ps->y = y;
+	ps->width = width;
+	ps->height = height;
+	ps->damage.num = 0;
+}
+
+static bool plane_changed(struct plane_state *old, struct plane_state *ps)
+{
+	return old->fb != ps->fb || old->x != ps->x || old->y != ps->y ||
+		old->width != ps->width || old->height != ps->height;
+}
+
+// damage_blob is set to the created damage clips blob if not NULL and
+// plane supports it
+static void add_plane_state(struct display_output *output, drmModeAtomicReq *req,
+			    struct plane *plane, struct plane_state *ps,
+			    uint32_t *damage_blob)
+{
+	if (!ps->fb) {
+		assert(drmModeAtomicAddProperty(req, plane->id, plane->fb_id, 0) >= 0);
+		assert(drmModeAtomicAddProperty(req, plane->id, plane->crtc_id, 0) >= 0);
+		return;
+	}
+
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->fb_id,
+					ps->fb->fb_id) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->crtc_id,
+					output->crtc->crtc_id) >= 0);
+
+	// source is in 16.16 fixed point
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->src_x, 0) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->src_y, 0) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->src_w,
+					(uint64_t)ps->width << 16) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->src_h,
+					(uint64_t)ps->height << 16) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->crtc_x, ps->x) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->crtc_y, ps->y) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->crtc_w, ps->width) >= 0);
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->crtc_h, ps->height) >= 0);
+
+	if (ps->wait_fd >= 0)
+		assert(drmModeAtomicAddProperty(req, plane->id, plane->in_fence_fd,
+						ps->wait_fd) >= 0);
+
+	// let driver only update changed area of the plane, no damage
+	// clips means the whole plane is damaged
+	if (damage_blob && plane->fb_damage_clips && ps->damage.num) {
+		struct drm_mode_rect clips[MAX_DAMAGE_RECTS];
+		for (int i = 0; i < ps->damage.num; i++) {
+			struct damage_rect *rect = ps->damage.rects + i;
+			clips[i].x1 = rect->x;
+			clips[i].y1 = rect->y;
+			clips[i].x2 = rect->x + rect->width;
+			clips[i].y2 = rect->y + rect->height;
+		}
+
+		assert(!drmModeCreatePropertyBlob(drm_fd, clips,
+						  sizeof(*clips) * ps->damage.num,
+						  damage_blob));
+		assert(drmModeAtomicAddProperty(req, plane->id, plane->fb_damage_clips,
+						*damage_blob) >= 0);
+	}
+}
+
+// empty request reused by all commits
+static drmModeAtomicReq *atomic_request(void)
+{
+	drmModeAtomicSetCursor(atomic_req, 0);
+	return atomic_req;
+}
+
+// check whether driver can show frame with primary plane in given state,
+// without touching the screen
+static bool test_frame(struct display_output *output, struct plane_state *primary,
+		       struct output_frame *frame)
+{
+	drmModeAtomicReq *req = atomic_request();
+
+	add_plane_state(output, req, output->planes, primary, NULL);
+	for (int i = 1; i < output->num_planes; i++)
+		add_plane_state(output, req, output->planes + i, frame->planes + i, NULL);
+
+	return !drmModeAtomicCommit(drm_fd, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+}
+
+// state of one output in a page flip commit
+struct output_flip {
+	struct display_output *output;
+	// head of queued frames
+	struct output_frame *frame;
+	int out_fence_fd;
+	uint32_t mode_blob;
+	uint32_t damage_blobs[MAX_PLANES];
+};
+
+static void add_output_flip(drmModeAtomicReq *req, struct output_flip *flip)
+{
+	struct display_output *output = flip->output;
+	struct output_frame *frame = flip->frame;
+	uint32_t crtc_id = output->crtc->crtc_id;
+
+	// get fence signaled when this commit is on screen
+	flip->out_fence_fd = -1;
+	assert(drmModeAtomicAddProperty(req, crtc_id, output->property_out_fence_ptr,
+					(uint64_t)(uintptr_t)&flip->out_fence_fd) >= 0);
+
+	// light up crtc with the mode along with the first frame
+	if (output->modeset) {
+		assert(!drmModeCreatePropertyBlob(drm_fd, &output->mode,
+						  sizeof(output->mode), &flip->mode_blob));
+		assert(drmModeAtomicAddProperty(req, crtc_id, output->property_mode_id,
+						flip->mode_blob) >= 0);
+		assert(drmModeAtomicAddProperty(req, crtc_id, output->property_active,
+						1) >= 0);
+		assert(drmModeAtomicAddProperty(req, output->connector->connector_id,
+						output->property_connector_crtc_id,
+						crtc_id) >= 0);
+	}
+
+	if (output->enable_vrr)
+		assert(drmModeAtomicAddProperty(req, crtc_id, output->property_vrr_enabled,
+						1) >= 0);
+
+	struct output_frame *showing_frame = output->showing_frame;
+	for (int i = 0; i < output->num_planes; i++) {
+		struct plane_state *ps = frame->planes + i;
+		struct plane_state *old = showing_frame ? showing_frame->planes + i : NULL;
+
+		// leave unchanged planes out, so driver doesn't update them
+		if (old && !plane_changed(old, ps) && ps->wait_fd < 0)
+			continue;
+
+		// damage is against old content of the plane, which is
+		// unknown when replacing the original fb
+		add_plane_state(output, req, output->planes + i, ps,
+				old && old->fb ? flip->damage_blobs + i : NULL);
+	}
+}
+
+static void output_flip_committed(struct output_flip *flip)
+{
+	struct display_output *output = flip->output;
+	struct output_frame *frame = flip->frame;
+
+	// crtc holds its own reference of the mode blob
+	if (flip->mode_blob) {
+		drmModeDestroyPropertyBlob(drm_fd, flip->mode_blob);
+		output->modeset = false;
+	}
+	output->enable_vrr = false;
+	output->flip_async = false;
+
+	for (int i = 0; i < output->num_planes; i++) {
+		struct plane_state *ps = frame->planes + i;
+		// commit holds its own reference of the blob
+		if (flip->damage_blobs[i])
+			drmModeDestroyPropertyBlob(drm_fd, flip->damage_blobs[i]);
+		if (ps->wait_fd >= 0) {
+			close(ps->wait_fd);
+			ps->wait_fd = -1;
+		}
+	}
+
+	// release showing frame now instead of waiting for page flip
+	// event, user of it waits for the out fence
+	assert(flip->out_fence_fd >= 0);
+	if (output->showing_frame)
+		release_frame(output, output->showing_frame, flip->out_fence_fd);
+	close(flip->out_fence_fd);
+
+	output->flip_pending = true;
+}
+
+// commit head pending frames of outputs in one atomic commit, so that they
+// flip at the same vblank when crtcs are in sync
+static void atomic_page_flip(struct display_output **flip_outputs, int num)
 {
-	int fd = open("/dev/dri/card0", O_RDWR);
-	assert(fd >= 0);
+	drmModeAtomicReq *req;
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	req = atomic_request();
+
+	struct output_flip flips[MAX_OUTPUTS] = {0};
+	for (int i = 0; i < num; i++) {
+		flips[i].output = flip_outputs[i];
+		flips[i].frame = *queued_frame(flip_outputs[i], 0);
+		// some drivers need full modeset to switch VRR
+		if (flip_outputs[i]->modeset || flip_outputs[i]->enable_vrr)
+			flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+		add_output_flip(req, flips + i);
+	}
 
-	drmModeResPtr res = drmModeGetResources(fd);
-	assert(res);
+	// each crtc gets its own page flip event
+	assert(!drmModeAtomicCommit(drm_fd, req, flags, NULL));
 
-	for (int i = 0; i < res->count_connectors; i++) {
-		connector = drmModeGetConnector(fd, res->connectors[i]);
-		assert(connector);
+	for (int i = 0; i < num; i++)
+		output_flip_committed(flips + i);
+}
 
-		// find a connected connection
-		if (connector->connection == DRM_MODE_CONNECTED)
-			break;
+// only fb of primary plane may change in an async flip
+static bool async_flip_allowed(struct display_output *output, struct output_frame *frame)
+{
+	struct output_frame *showing_frame = output->showing_frame;
+	if (!output->tearing || !showing_frame || output->modeset || output->enable_vrr)
+		return false;
+
+	struct plane_state *old = showing_frame->planes;
+	struct plane_state *ps = frame->planes;
+	if (!old->fb || !ps->fb || old->x != ps->x || old->y != ps->y ||
+	    old->width != ps->width || old->height != ps->height)
+		return false;
+
+	for (int i = 1; i < output->num_planes; i++) {
+		if (plane_changed(showing_frame->planes + i, frame->planes + i) ||
+		    frame->planes[i].wait_fd >= 0)
+			return false;
+	}
+	return true;
+}
 
-		drmFree(connector);
-		connector = NULL;
+// replace fb of primary plane at once instead of at vblank, return false
+// when the frame can't be shown that way and needs a normal commit
+static bool async_page_flip(struct display_output *output)
+{
+	struct output_frame *frame = *queued_frame(output, 0);
+	if (!async_flip_allowed(output, frame))
+		return false;
+
+	drmModeAtomicReq *req = atomic_request();
+
+	struct plane *plane = output->planes;
+	struct plane_state *ps = frame->planes;
+	assert(drmModeAtomicAddProperty(req, plane->id, plane->fb_id,
+					ps->fb->fb_id) >= 0);
+	if (ps->wait_fd >= 0)
+		assert(drmModeAtomicAddProperty(req, plane->id, plane->in_fence_fd,
+						ps->wait_fd) >= 0);
+
+	// driver may reject other property or plane in async flip
+	int ret = drmModeAtomicCommit(drm_fd, req,
+				      DRM_MODE_PAGE_FLIP_EVENT |
+				      DRM_MODE_ATOMIC_NONBLOCK |
+				      DRM_MODE_PAGE_FLIP_ASYNC,
+				      NULL);
+	if (ret)
+		return false;
+
+	if (ps->wait_fd >= 0) {
+		close(ps->wait_fd);
+		ps->wait_fd = -1;
 	}
-	assert(connector);
 
-	drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoder_id);
-	assert(encoder);
+	// showing frame is released by the page flip event, which comes
+	// once it's replaced
+	output->flip_pending = true;
+	output->flip_async = true;
+	return true;
+}
 
-	crtc = drmModeGetCrtc(fd, encoder->crtc_id);
-	assert(crtc);
+// commit frames waiting for page flip, in sync mode outputs wait for each
+// other and flip together once none of them has a flip in flight, async
+// flips are per crtc so they are not used in sync mode
+static void commit_frames(void)
+{
+	struct display_output *flip_outputs[MAX_OUTPUTS];
+	int num = 0;
+
+	for (int i = 0; i < num_outputs; i++) {
+		struct display_output *output = outputs + i;
+		if (output->flip_pending) {
+			if (config.sync_outputs)
+				return;
+			continue;
+		}
 
-	// original fb used for terminal
-	orig_fb = drmModeGetFB(fd, crtc->buffer_id);
-	assert(orig_fb);
+		if (!output->num_queued)
+			continue;
 
-	drm_fd = fd;
-	state.fd = fd;
-	state.target_width = orig_fb->width;
-	state.target_height = orig_fb->height;
+		if (config.sync_outputs)
+			flip_outputs[num++] = output;
+		else if (!async_page_flip(output))
+			atomic_page_flip(&output, 1);
+	}
 
-	drmFree(encoder);
-	drmFree(res);
+	if (num)
+		atomic_page_flip(flip_outputs, num);
 }
 
-static uint32_t plane_id = 0;
-static uint32_t property_fb_id = 0;
-static uint32_t property_in_fence_fd = 0;
-static uint32_t property_out_fence_ptr = 0;
+static void send_skipped(struct feedback *feedback)
+{
+	struct message msg = {
+		.type = MESSAGE_PRESENT_SKIPPED,
+		.present_skipped = {
+			.index = feedback->index,
+		},
+	};
+	client_send(feedback->client, &msg, NULL, 0);
+}
 
-static void atomic_mode_setting_init(void)
+// drop old frame not shown yet, frame which replaces it takes its place
+static void mailbox_replace(struct display_output *output, struct output_frame *old,
+			    struct output_frame *frame)
 {
-	// enable atomic mode setting
-	assert(!drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1));
+	for (int i = 0; i < output->num_planes; i++) {
+		struct plane_state *o = old->planes + i;
+		struct plane_state *ps = frame->planes + i;
+
+		// plane keeps content of old, which may not be ready yet,
+		// commit waits both in kernel
+		if (o->fb == ps->fb) {
+			ps->wait_fd = merge_fence(ps->wait_fd, o->wait_fd);
+			o->wait_fd = -1;
+		}
 
-	drmModePlaneRes *plane_res = drmModeGetPlaneResources(drm_fd);
-	assert(plane_res);
-	// find plane used by target crtc
-	for (int i = 0; i < plane_res->count_planes; i++) {
-		drmModePlanePtr plane = drmModeGetPlane(drm_fd, plane_res->planes[i]);
-		if (plane->crtc_id == crtc->crtc_id)
-			plane_id = plane->plane_id;
-		drmModeFreePlane(plane);
-		if (plane_id)
-			break;
+		// damage of frame is against old, against screen it's both
+		// of them
+		if (!o->damage.num)
+			ps->damage.num = 0;
+		else if (ps->damage.num)
+			region_union(output, &ps->damage, &o->damage);
 	}
-	drmModeFreePlaneResources(plane_res);
-	assert(plane_id);
-
-	drmModeObjectProperties *props;
-	drmModePropertyPtr property;
-
-	props = drmModeObjectGetProperties(drm_fd, plane_id, DRM_MODE_OBJECT_PLANE);
-	assert(props);
-	// find property according to the name
-	for (int i = 0; i < props->count_props; i++) {
-		property = drmModeGetProperty(drm_fd, props->props[i]);
-		if (!strcmp(property->name, "FB_ID"))
-			property_fb_id = property->prop_id;
-		else if (!strcmp(property->name, "IN_FENCE_FD"))
-			property_in_fence_fd = property->prop_id;
-		drmModeFreeProperty(property);
-	}
-	drmModeFreeObjectProperties(props);
-	assert(property_fb_id);
-	assert(property_in_fence_fd);
-
-	props = drmModeObjectGetProperties(drm_fd, crtc->crtc_id, DRM_MODE_OBJECT_CRTC);
-	assert(props);
-	for (int i = 0; i < props->count_props; i++) {
-		property = drmModeGetProperty(drm_fd, props->props[i]);
-		if (!strcmp(property->name, "OUT_FENCE_PTR"))
-			property_out_fence_ptr = property->prop_id;
-		drmModeFreeProperty(property);
-	}
-	drmModeFreeObjectProperties(props);
-	assert(property_out_fence_ptr);
+
+	release_frame(output, old, -1);
+
+	while (old->feedbacks) {
+		struct feedback *feedback = old->feedbacks;
+		old->feedbacks = feedback->next;
+
+		struct feedback *newer = frame->feedbacks;
+		while (newer && newer->client != feedback->client)
+			newer = newer->next;
+
+		if (newer) {
+			// client frame is replaced by its newer one
+			send_skipped(feedback);
+			free(feedback);
+		} else {
+			// client frame is still shown by frame
+			feedback->next = frame->feedbacks;
+			frame->feedbacks = feedback;
+		}
+	}
+
+	free(old);
 }
 
-static const char vertex_shader[] =
-	"attribute vec3 positionIn;\n"
-	"attribute vec2 texcoordIn;\n"
-	"varying vec2 texcoord;\n"
-	"void main()\n"
-	"{\n"
-	"    gl_Position = vec4(positionIn, 1);\n"
-	"    texcoord = texcoordIn;\n"
-	"}\n";
+// queue frame for page flip, it holds a reference of each framebuffer
+static void queue_frame(struct display_output *output, struct output_frame *frame)
+{
+	for (int i = 0; i < output->num_planes; i++) {
+		if (frame->planes[i].fb)
+			frame->planes[i].fb->refs++;
+	}
 
-static const char fragment_shader[] =
-	"precision mediump float;\n"
-	"uniform sampler2D texMap;\n"
-	"varying vec2 texcoord;\n"
-	"void main() {\n"
-	"    gl_FragColor = texture2D(texMap, texcoord);\n"
-	"}\n";
+	uint64_t time;
+	predict_flip(output, &frame->expected_sequence, &time);
+
+	// frames after the committed head are waiting
+	int waiting = output->flip_pending ? 1 : 0;
+	// torn flips replace scanout at once, there is no point to queue
+	if ((config.present_mode == PRESENT_MODE_MAILBOX || output->tearing) &&
+	    output->num_queued > waiting) {
+		// replace the one waiting for commit
+		assert(output->num_queued == waiting + 1);
+		struct output_frame **old = queued_frame(output, waiting);
+		mailbox_replace(output, *old, frame);
+		*old = frame;
+	} else {
+		// pend page flip request will be consumed by drm event handler
+		// queue request to ring tail
+		assert(output->num_queued < MAX_QUEUED_FRAMES);
+		*queued_frame(output, output->num_queued++) = frame;
+	}
+
+	commit_frames();
+}
 
-static int composite(int fd)
+// called when gbm surface destroys bo
+static void destroy_output_fb(struct gbm_bo *bo, void *data)
 {
-	struct present_buffer data;
-	int fds[2];
-	int num_fd = 2;
-
-	// get new window frame from client
-	ssize_t size = sock_fd_read(fd, &data, sizeof(data), fds, &num_fd);
-	assert(size > 0);
-	assert(num_fd >= 1);
-
-	int buffer_fd = fds[0];
-	int wait_fd = num_fd == 2 ? fds[1] : -1;
-
-	struct gbm_import_fd_data gbm_data = {
-		.fd = buffer_fd,
-		.width = data.width,
-		.height = data.height,
-		.stride = data.stride,
-		.format = data.format,
-	};
+	struct display_framebuffer *fb = data;
+	drmModeRmFB(drm_fd, fb->fb_id);
+	free(fb);
+}
 
-	struct gbm_bo *bo = gbm_bo_import(
-		state.gbm, GBM_BO_IMPORT_FD,
-		&gbm_data, GBM_BO_USE_RENDERING);
+// framebuffer of the composited output
+static struct display_framebuffer *output_framebuffer(struct display_output *output)
+{
+	struct gbm_bo *bo = gbm_surface_lock_front_buffer(output->gs);
 	assert(bo);
 
-	// close after usage
-	close(buffer_fd);
+	// framebuffer lives with bo, create one when bo is new
+	struct display_framebuffer *fb = gbm_bo_get_user_data(bo);
+	if (fb)
+		return fb;
 
-	epoxy_has_egl_extension(state.display, "EGL_KHR_image_pixmap");
+	fb = calloc(1, sizeof(*fb));
+	assert(fb);
+	fb->bo = bo;
 
-	EGLImageKHR image = eglCreateImageKHR(
-		state.display, state.context,
-		EGL_NATIVE_PIXMAP_KHR, bo, NULL);
-	assert(image != EGL_NO_IMAGE_KHR);
+	// alpha of output is meaningless on screen
+	assert(!add_framebuffer(bo, DRM_FORMAT_XRGB8888, &fb->fb_id));
+	gbm_bo_set_user_data(bo, fb, destroy_output_fb);
+	return fb;
+}
 
-	// destroy after usage
-	gbm_bo_destroy(bo);
+// topmost client on output covering the whole of it with a buffer the
+// primary plane can scan out, its due frame can be shown without composite
+static struct client *scanout_candidate(struct display_output *output)
+{
+	struct client *top = NULL;
+	for (struct client *client = clients; client; client = client->next) {
+		struct present_buffer *data = shown_frame(client);
+		if (data && window_on_output(client, data, output))
+			top = client;
+	}
+	if (!top || !top->pending_due)
+		return NULL;
+
+	struct present_buffer *data = &top->pending;
+	struct client_buffer *buffer = top->buffers[data->id];
+	if (!buffer->fb || data->x != output->x || data->y ||
+	    buffer->width != output->width ||
+	    buffer->height != output->height ||
+	    !plane_support_format(output->planes, scanout_format(buffer->bo)))
+		return NULL;
+
+	return top;
+}
 
-	glActiveTexture(GL_TEXTURE0);
+// put client buffer on primary plane directly, return false when need
+// composite
+static bool scanout(struct display_output *output, struct output_frame *frame)
+{
+	struct client *top = scanout_candidate(output);
+	if (!top)
+		return false;
+
+	struct client_buffer *buffer = top->buffers[top->pending.id];
+	set_plane_state(frame->planes, buffer->fb, 0, 0,
+			buffer->width, buffer->height);
+
+	// frames of clients below are hidden, but still consumed by this
+	// output frame
+	for (struct client *client = clients; client; client = client->next) {
+		if (client->plane_output == output) {
+			client->plane = 0;
+			client->plane_output = NULL;
+		}
+		if (client->pending_due)
+			update_current(output, client, &frame->feedbacks);
+	}
 
-	epoxy_has_gl_extension("GL_OES_EGL_image");
+	// composited output buffers don't have what is shown now
+	output->stale = true;
+	output->damage.num = 0;
+	return true;
+}
 
-	GLuint texid;
-	glGenTextures(1, &texid);
-	glBindTexture(GL_TEXTURE_2D, texid);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
-
-	// destroy after usage
-	eglDestroyImageKHR(state.display, image);
-
-	// wait client render is done before composite
-	if (wait_fd >= 0) {
-		wait_fence(state.display, wait_fd);
-		close(wait_fd);
-	}
-
-	GLfloat x = -1.0 + data.x * 2.0 / state.target_width;
-	GLfloat y = 1.0 - data.y * 2.0 / state.target_height;
-	GLfloat w = x + data.width * 2.0 / state.target_width;
-	GLfloat h = y - data.height * 2.0 / state.target_height;
-		
-	GLfloat vertex[] = {
-		x, h, 0,
-		x, y, 0,
-		w, y, 0,
-		w, h, 0,
-	};
+static struct client *client_below(struct client *above)
+{
+	struct client *below = NULL;
+	for (struct client *client = clients; client != above; client = client->next)
+		below = client;
+	return below;
+}
 
-	GLfloat texcoord[] = {
-		0, 1,
-		0, 0,
-		1, 0,
-		1, 1,
-	};
+// put topmost clients on overlay planes of output, the top one on the
+// highest plane, stop at the first client which doesn't fit, so that
+// composited clients are all below overlays
+static void assign_overlays(struct display_output *output, struct output_frame *frame)
+{
+	struct client *assigned[MAX_PLANES] = {0};
+
+	// test needs state of primary plane, which is the latest one as
+	// composite has not been done yet
+	struct output_frame *latest = latest_frame(output);
+	int next_plane = latest ? output->num_planes - 1 : 0;
+	for (struct client *client = client_below(NULL);
+	     client && next_plane > 0; client = client_below(client)) {
+		struct present_buffer *data = shown_frame(client);
+		if (!data || !window_on_output(client, data, output))
+			continue;
+
+		// window spanning outputs is composited on each of them
+		struct client_buffer *buffer = client->buffers[data->id];
+		if (!window_inside_output(client, data, output) || !buffer->fb ||
+		    !plane_support_format(output->planes + next_plane,
+					  scanout_format(buffer->bo)))
+			break;
 
-	GLushort index[] = {
-		0, 1, 3,
-		1, 2, 3,
-	};
+		struct plane_state *ps = frame->planes + next_plane;
+		set_plane_state(ps, buffer->fb, data->x - output->x, data->y,
+				buffer->width, buffer->height);
+		if (!test_frame(output, latest->planes, frame)) {
+			ps->fb = NULL;
+			break;
+		}
 
-	GLint pos = glGetAttribLocation(state.program, "positionIn");
-        glEnableVertexAttribArray(pos);
-	glVertexAttribPointer(pos, 3, GL_FLOAT, 0, 0, vertex);
+		assigned[next_plane--] = client;
+	}
 
-	GLint tex = glGetAttribLocation(state.program, "texcoordIn");
-        glEnableVertexAttribArray(tex);
-	glVertexAttribPointer(tex, 2, GL_FLOAT, 0, 0, texcoord);
+	for (struct client *client = clients; client; client = client->next) {
+		int plane = 0;
+		for (int i = 1; i < output->num_planes; i++) {
+			if (assigned[i] == client)
+				plane = i;
+		}
 
-	GLint texMap = glGetUniformLocation(state.program, "texMap");
-	glUniform1i(texMap, 0); // GL_TEXTURE0
+		// window moves between primary and overlay, primary needs
+		// repaint where it was or will be
+		if (!plane != !client_plane(client, output)) {
+			if (client->has_current)
+				damage_output_window(output, client, &client->current);
+			if (client->pending_due)
+				damage_output_window(output, client, &client->pending);
+		}
 
-	glClear(GL_COLOR_BUFFER_BIT);
+		if (plane) {
+			client->plane = plane;
+			client->plane_output = output;
+		} else if (client->plane_output == output) {
+			client->plane = 0;
+			client->plane_output = NULL;
+		}
+	}
+}
 
-	glDrawElements(GL_TRIANGLES, sizeof(index)/sizeof(GLushort), GL_UNSIGNED_SHORT, index);
+// composited part of output changed
+static bool primary_dirty(struct display_output *output)
+{
+	if (output->damage.num || output->stale)
+		return true;
 
-	// after composite is done, this fence will be signaled
-	int signal_fd = get_fence(state.display);
+	for (struct client *client = clients; client; client = client->next) {
+		if (!client_plane(client, output) && client->pending_due)
+			return true;
+	}
+	return false;
+}
 
-	// swap back buffer to front
-	eglSwapBuffers(state.display, state.surface);
+// build output frame from latest frames of clients on output
+static struct output_frame *build_frame(struct display_output *output)
+{
+	struct output_frame *frame = create_frame(output);
 
-	// delete after usage
-	glDeleteTextures(1, &texid);
+	// fullscreen client frame goes to primary plane directly, which
+	// saves GPU composite and a copy
+	if (scanout(output, frame))
+		return frame;
 
-	// infom client window frame has been consumed
-	struct present_done done = {
-		.index = data.index,
-	};
-	if (signal_fd >= 0)
-		size = sock_fd_write(fd, &done, sizeof(done), &signal_fd, 1);
-	else
-		size = sock_fd_write(fd, &done, sizeof(done), NULL, 0);
-	assert(size > 0);
+	// offload clients to overlays, even one saves a composite pass
+	assign_overlays(output, frame);
 
-	return signal_fd;
-}
+	struct plane_state *primary = frame->planes;
+	if (primary_dirty(output)) {
+		struct region frame_damage;
+		int signal_fd = composite(output, &frame_damage, &frame->feedbacks);
 
-struct display_framebuffer {
-	struct gbm_bo *bo;
-	uint32_t fb_id;
-	struct display_framebuffer *next;
-	int wait_fd;
-};
+		set_plane_state(primary, output_framebuffer(output), 0, 0,
+				output->width, output->height);
+		primary->wait_fd = signal_fd;
+		primary->damage = frame_damage;
+	} else {
+		// only overlays changed, primary keeps its content
+		struct output_frame *latest = latest_frame(output);
+		assert(latest);
+		*primary = latest->planes[0];
+		primary->wait_fd = -1;
+		primary->damage.num = 0;
+	}
+
+	for (struct client *client = clients; client; client = client->next) {
+		int plane = client_plane(client, output);
+		if (plane && client->pending_due)
+			update_current(output, client, &frame->feedbacks);
+	}
 
-// assume max number of bos in a gbm_surface is less than 32
-#define MAX_BOS 32
-struct display_framebuffer fbs[MAX_BOS] = {0};
-// fb which is on screen
-struct display_framebuffer *showing_fb = NULL;
-// fbs pending to be show on screen
-struct display_framebuffer *pending_fbs = NULL;
+	return frame;
+}
 
-static void atomic_page_flip(struct display_framebuffer *fb)
+static void feedback_remove_client(struct client *client)
 {
-	drmModeAtomicReq *req;
+	// client frames may still be in output frames waiting for page flip
+	for (int i = 0; i < num_outputs; i++) {
+		for (int j = 0; j < outputs[i].num_queued; j++) {
+			struct output_frame *frame = *queued_frame(outputs + i, j);
+			struct feedback **prev = &frame->feedbacks;
+			while (*prev) {
+				struct feedback *feedback = *prev;
+				if (feedback->client == client) {
+					*prev = feedback->next;
+					free(feedback);
+				} else
+					prev = &feedback->next;
+			}
+		}
+	}
+}
 
-	req = drmModeAtomicAlloc();
-	assert(req);
+static void predict_flip(struct display_output *output, uint64_t *sequence,
+			 uint64_t *time)
+{
+	// no flip yet, show everything as soon as possible
+	if (!output->last_flip_time) {
+		*sequence = UINT64_MAX;
+		*time = UINT64_MAX;
+		return;
+	}
 
-	assert(drmModeAtomicAddProperty(req, plane_id, property_fb_id,
-					fb->fb_id) >= 0);
+	// each queued frame takes one vblank
+	uint64_t vblanks = 1 + output->num_queued;
 
-	assert(drmModeAtomicAddProperty(req, plane_id, property_in_fence_fd,
-					fb->wait_fd) >= 0);
+	uint64_t now = get_time_ns();
+	if (output->tearing) {
+		// flip replaces scanout without waiting for vblank
+		*sequence = output->last_flip_sequence + vblanks;
+		*time = now;
+		return;
+	}
 
-	assert(!drmModeAtomicCommit(drm_fd, req,
-				    DRM_MODE_PAGE_FLIP_EVENT |
-				    DRM_MODE_ATOMIC_NONBLOCK,
-				    NULL));
+	// panel waits for the commit, which flips as soon as the queued
+	// frames are shown, no faster than refresh rate of mode
+	if (output->vrr) {
+		*sequence = output->last_flip_sequence + vblanks;
+		*time = output->last_flip_time + vblanks * output->refresh_ns;
+		if (*time < now)
+			*time = now;
+		return;
+	}
 
-	drmModeAtomicFree(req);
+	// vblanks passed without flip since the last event
+	if (now > output->last_flip_time)
+		vblanks += (now - output->last_flip_time) / output->refresh_ns;
 
-	if (fb->wait_fd >= 0)
-		close(fb->wait_fd);
+	*sequence = output->last_flip_sequence + vblanks;
+	*time = output->last_flip_time + vblanks * output->refresh_ns;
 }
 
-static void display_output(int wait_fd)
+static void update_flip_time(struct display_output *output, uint32_t frame,
+			     uint32_t sec, uint32_t usec)
 {
-	struct gbm_bo *bo = gbm_surface_lock_front_buffer(state.gs);
-	assert(bo);
+	output->last_flip_sequence = frame;
+	output->last_flip_time = sec * 1000000000ull + usec * 1000ull;
+}
 
-	// find existing framebuffer, create one if not exist
-	struct display_framebuffer *fb = NULL;
-	for (int i = 0; i < MAX_BOS; i++) {
-		if (!fbs[i].bo || fbs[i].bo == bo) {
-			fb = fbs + i;
-			break;
-		}
+#define MIN_REPAINT_OFFSET 1000000ull
+
+static void repaint_init(struct display_output *output)
+{
+	output->repaint_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						  TFD_NONBLOCK | TFD_CLOEXEC);
+	assert(output->repaint_timer_fd >= 0);
+
+	// start from a safe offset when auto tune
+	output->repaint_offset = config.repaint_offset ?
+		config.repaint_offset * 1000ull : output->refresh_ns / 2;
+}
+
+// composite later when miss vblank, earlier when always hit for a while
+static void tune_repaint_offset(struct display_output *output,
+				struct output_frame *frame)
+{
+	if (config.repaint_offset || output->vrr || output->tearing ||
+	    frame->expected_sequence == UINT64_MAX)
+		return;
+
+	if (output->last_flip_sequence > frame->expected_sequence) {
+		output->repaint_offset += output->refresh_ns / 8;
+		if (output->repaint_offset > output->refresh_ns)
+			output->repaint_offset = output->refresh_ns;
+		output->repaint_hits = 0;
+	} else if (++output->repaint_hits >= 60) {
+		output->repaint_offset -= 50000;
+		if (output->repaint_offset < MIN_REPAINT_OFFSET)
+			output->repaint_offset = MIN_REPAINT_OFFSET;
 	}
+}
 
-	if (!fb->bo) {
-		assert(!drmModeAddFB(drm_fd, gbm_bo_get_width(bo),
-				     gbm_bo_get_height(bo), 24,
-				     gbm_bo_get_bpp(bo),
-				     gbm_bo_get_stride(bo),
-				     gbm_bo_get_handle(bo).u32,
-				     &fb->fb_id));
-		fb->bo = bo;
+// arm timer to composite just before the vblank an output frame
+// composited now is expected to be shown at
+static void schedule_repaint(struct display_output *output, bool only_held)
+{
+	if (output->repaint_scheduled)
+		return;
+
+	uint64_t sequence, time;
+	predict_flip(output, &sequence, &time);
+
+	// with VRR or tearing new frames are composited and committed at
+	// once, the flip waits until the panel can refresh again or not
+	bool at_once = (output->vrr || output->tearing) && !only_held;
+
+	uint64_t now = get_time_ns();
+	uint64_t repaint_time = now;
+	if (time != UINT64_MAX && !at_once) {
+		repaint_time = time > output->repaint_offset ?
+			time - output->repaint_offset : now;
+
+		// only wait for held frames, skip vblanks whose repaint
+		// time has passed
+		while (only_held && repaint_time <= now)
+			repaint_time += output->refresh_ns;
 	}
 
-	fb->wait_fd = wait_fd;
-	fb->next = NULL;
-	if (!pending_fbs) {
-		// need to kick start page flip first time
-		atomic_page_flip(fb);
-		pending_fbs = fb;
-	} else {
-		// pend page flip request will be consumed by drm event handler
-		struct display_framebuffer *pfb = pending_fbs;
-		// queue request to list tail
-		while (pfb->next) pfb = pfb->next;
-		pfb->next = fb;
+	// zero time disarms the timer, past time fires at once
+	if (!repaint_time)
+		repaint_time = 1;
+
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = repaint_time / 1000000000,
+			.tv_nsec = repaint_time % 1000000000,
+		},
+	};
+	assert(!timerfd_settime(output->repaint_timer_fd, TFD_TIMER_ABSTIME, &its, NULL));
+	output->repaint_scheduled = true;
+}
+
+// there is a free framebuffer for composite and room in flip queue
+static bool can_queue_frame(struct display_output *output)
+{
+	return gbm_surface_has_free_buffers(output->gs) &&
+		output->num_queued < MAX_QUEUED_FRAMES;
+}
+
+static void repaint(struct display_output *output)
+{
+	uint64_t expirations;
+	read(output->repaint_timer_fd, &expirations, sizeof(expirations));
+	output->repaint_scheduled = false;
+
+	// show latest frames of clients on output once when there is a free
+	// framebuffer for composite
+	if (need_composite(output) && can_queue_frame(output))
+		queue_frame(output, build_frame(output));
+}
+
+// tell clients their frames are shown on screen
+static void send_feedbacks(struct display_output *output, struct output_frame *frame,
+			   uint32_t sequence, uint32_t sec, uint32_t usec)
+{
+	while (frame->feedbacks) {
+		struct feedback *feedback = frame->feedbacks;
+		struct message msg = {
+			.type = MESSAGE_PRESENT_FEEDBACK,
+			.present_feedback = {
+				.id = feedback->id,
+				.index = feedback->index,
+				.sequence = sequence,
+				.timestamp = sec * 1000000000ull + usec * 1000ull,
+				.refresh = output->refresh_ns,
+			},
+		};
+		client_send(feedback->client, &msg, NULL, 0);
+
+		frame->feedbacks = feedback->next;
+		free(feedback);
 	}
 }
 
+static struct display_output *crtc_output(uint32_t crtc_id)
+{
+	for (int i = 0; i < num_outputs; i++) {
+		if (outputs[i].crtc->crtc_id == crtc_id)
+			return outputs + i;
+	}
+	return NULL;
+}
+
+// one event for each crtc of a commit
 static void
 page_flip_handler(int fd, uint32_t frame, uint32_t sec, uint32_t usec,
-		  void *user_ptr)
+		  uint32_t crtc_id, void *user_ptr)
 {
-	assert(pending_fbs);
+	struct display_output *output = crtc_output(crtc_id);
+	assert(output && output->flip_pending);
+
+	// framebuffers of replaced showing frame are released when commit,
+	// except for async flip without out fence, which is done by now
+	if (output->flip_async && output->showing_frame)
+		release_frame(output, output->showing_frame, -1);
+	output->flip_async = false;
+	free(output->showing_frame);
+	output->showing_frame = *queued_frame(output, 0);
+	output->queue_head = (output->queue_head + 1) % MAX_QUEUED_FRAMES;
+	output->num_queued--;
+	output->flip_pending = false;
+
+	update_flip_time(output, frame, sec, usec);
+	tune_repaint_offset(output, output->showing_frame);
+
+	send_feedbacks(output, output->showing_frame, frame, sec, usec);
+
+	commit_frames();
+}
 
-	// release replaced previous showing framebuffer
-	if (showing_fb)
-		gbm_surface_release_buffer(state.gs, showing_fb->bo);
+// release frame replaced by a newer one before composited
+static void drop_frame(struct client *client, struct present_buffer *data)
+{
+	send_done(client, data->id, data->index, NULL, 0);
 
-	showing_fb = pending_fbs;
-	pending_fbs = pending_fbs->next;
-	if (pending_fbs)
-		atomic_page_flip(pending_fbs);
+	struct message msg = {
+		.type = MESSAGE_PRESENT_SKIPPED,
+		.present_skipped = {
+			.index = data->index,
+		},
+	};
+	client_send(client, &msg, NULL, 0);
 }
 
-static int dispatch_fd;
+static void drop_pending(struct client *client)
+{
+	drop_frame(client, &client->pending);
+	client->has_pending = false;
+	client->pending_due = false;
+}
 
-static void dispatch_add(int fd)
+
+// damage of data is against old, which is dropped, against the frame
+// before old it's both of them, whole window when they can't be merged
+static void merge_damage(struct client *client, struct present_buffer *data,
+			 struct present_buffer *old)
 {
-	struct epoll_event event = {
-		.events = EPOLLIN,
-		.data.fd = fd,
+	struct client_buffer *buffer = client->buffers[data->id];
+	struct client_buffer *old_buffer = client->buffers[old->id];
+
+	if (!data->num_damage)
+		return;
+	if (!old->num_damage || old->x != data->x || old->y != data->y ||
+	    old_buffer->width != buffer->width || old_buffer->height != buffer->height ||
+	    data->num_damage + old->num_damage > MAX_DAMAGE_RECTS) {
+		data->num_damage = 0;
+		return;
+	}
+
+	memcpy(data->damage + data->num_damage, old->damage,
+	       old->num_damage * sizeof(*old->damage));
+	data->num_damage += old->num_damage;
+}
+
+// render of frame is done, it replaces the older pending frame
+static void set_pending(struct client *client, struct present_buffer *data)
+{
+	if (client->has_pending) {
+		merge_damage(client, data, &client->pending);
+		drop_pending(client);
+	}
+
+	client->pending = *data;
+	client->has_pending = true;
+}
+
+// sync_file polls readable once signaled
+static bool fence_signaled(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
 	};
-	assert(!epoll_ctl(dispatch_fd, EPOLL_CTL_ADD, fd, &event));
+	return poll(&pfd, 1, 0) > 0;
 }
 
-static void dispatch_remove(int fd)
+// client render should be done before the composite of the vblank its
+// frame targets starts
+static void set_client_deadline(struct client *client, struct fenced_frame *frame)
 {
-	assert(!epoll_ctl(dispatch_fd, EPOLL_CTL_DEL, fd, NULL));
+	struct display_output *output = client_output(client);
+	struct present_buffer *data = &frame->data;
+
+	uint64_t sequence, time;
+	predict_flip(output, &sequence, &time);
+	if (time == UINT64_MAX)
+		return;
+
+	if (data->target_sequence > sequence)
+		time += (data->target_sequence - sequence) * output->refresh_ns;
+	if (data->target_time > time)
+		time = data->target_time;
+
+	set_fence_deadline(frame->fd, time > output->repaint_offset ?
+			   time - output->repaint_offset : time);
+}
+
+// wait render of client frame to be done before compositing it
+static void add_fenced(struct client *client, struct present_buffer *data, int fd)
+{
+	struct fenced_frame *frame = malloc(sizeof(*frame));
+	assert(frame);
+	frame->data = *data;
+	frame->fd = fd;
+	frame->next = NULL;
+
+	struct fenced_frame **tail = &client->fenced;
+	while (*tail) tail = &(*tail)->next;
+	*tail = frame;
+
+	dispatch_add(fd);
+	set_client_deadline(client, frame);
+}
+
+// fenced frames presented before data, up to stop, are replaced by it
+static void drop_fenced(struct client *client, struct fenced_frame *stop,
+			struct present_buffer *data)
+{
+	while (client->fenced != stop) {
+		struct fenced_frame *old = client->fenced;
+		client->fenced = old->next;
+		dispatch_remove(old->fd);
+		close(old->fd);
+		merge_damage(client, data, &old->data);
+		drop_frame(client, &old->data);
+		free(old);
+	}
+}
+
+// fenced frame of client is ready, GPU of server never waits on client
+// render, so a slow client doesn't delay composite of others, older
+// frames are replaced by it and newer ones keep waiting
+static void fence_dispatch(struct client *client, struct fenced_frame *frame)
+{
+	// event may be for a closed fence whose fd is reused by this one
+	if (!fence_signaled(frame->fd))
+		return;
+
+	drop_fenced(client, frame, &frame->data);
+	client->fenced = frame->next;
+
+	dispatch_remove(frame->fd);
+	close(frame->fd);
+	set_pending(client, &frame->data);
+	free(frame);
+}
+
+// client sends invalid request, it's dropped with fds it sends
+static void client_invalid(struct client *client, int *fds, int num_fd,
+			   const char *error)
+{
+	fprintf(stderr, "client %d: %s\n", client->fd, error);
+	for (int i = 0; i < num_fd; i++)
+		close(fds[i]);
+	client->dead = true;
+}
+
+static void client_dispatch(struct client *client)
+{
+	struct message msg;
+	int fds[MAX_BUFFER_PLANES];
+	int num_fd = MAX_BUFFER_PLANES;
+
+	ssize_t size = sock_fd_read(client->fd, &msg, sizeof(msg), fds, &num_fd);
+	if (size <= 0) {
+		// client disconnected or reset the connection
+		client_invalid(client, fds, num_fd, "disconnected");
+		return;
+	}
+	if (size != sizeof(msg)) {
+		client_invalid(client, fds, num_fd, "short message");
+		return;
+	}
+
+	switch (msg.type) {
+	case MESSAGE_REGISTER_BUFFER:
+		if (!num_fd || !register_buffer(client, &msg.register_buffer, fds, num_fd))
+			client_invalid(client, fds, num_fd, "invalid buffer");
+		break;
+	case MESSAGE_REGISTER_TIMELINE:
+		if (!transfer_syncobj)
+			assert(!drmSyncobjCreate(drm_fd, 0, &transfer_syncobj));
+		if (num_fd != 2 || client->acquire_syncobj ||
+		    drmSyncobjFDToHandle(drm_fd, fds[0], &client->acquire_syncobj) ||
+		    drmSyncobjFDToHandle(drm_fd, fds[1], &client->release_syncobj)) {
+			client_invalid(client, fds, num_fd, "invalid timeline");
+			break;
+		}
+		close(fds[0]);
+		close(fds[1]);
+		break;
+	case MESSAGE_PRESENT_BUFFER: {
+		// buffer must be registered before present
+		uint32_t id = msg.present_buffer.id;
+		if (id >= client->num_buffers) {
+			client_invalid(client, fds, num_fd, "present invalid buffer");
+			return;
+		}
+
+		// render fence of client timeline, polled like a fd from client
+		int fence_fd = num_fd ? fds[0] : -1;
+		if (msg.present_buffer.acquire_point && client->acquire_syncobj) {
+			fence_fd = syncobj_export(drm_fd, transfer_syncobj,
+						  client->acquire_syncobj,
+						  msg.present_buffer.acquire_point);
+			if (fence_fd < 0) {
+				client_invalid(client, fds, num_fd, "acquire point not submitted");
+				return;
+			}
+		}
+
+		// implicit sync client, fence is taken from its buffer, so it's
+		// scheduled the same as explicit ones
+		struct client_buffer *buffer = client->buffers[id];
+		buffer->implicit = fence_fd < 0;
+		if (buffer->implicit)
+			fence_fd = dmabuf_export_fence(buffer->dmabuf_fd);
+
+		// get client output, will be composited with other clients
+		// once its render is done, until then the older frame is shown
+		if (fence_fd >= 0 && !fence_signaled(fence_fd))
+			add_fenced(client, &msg.present_buffer, fence_fd);
+		else {
+			if (fence_fd >= 0)
+				close(fence_fd);
+			drop_fenced(client, NULL, &msg.present_buffer);
+			set_pending(client, &msg.present_buffer);
+		}
+
+		// frame held for its target should not be replaced, does not
+		// handle new request of this client until it is composited
+		if (msg.present_buffer.target_sequence || msg.present_buffer.target_time)
+			client_listen(client, false);
+		break;
+	}
+	default:
+		client_invalid(client, fds, num_fd, "invalid message");
+		break;
+	}
+}
+
+// find output whose repaint timer is fd, NULL if none
+static struct display_output *repaint_output(int fd)
+{
+	for (int i = 0; i < num_outputs; i++) {
+		if (outputs[i].repaint_timer_fd == fd)
+			return outputs + i;
+	}
+	return NULL;
 }
 
 static bool stop = false;
@@ -371,10 +2804,39 @@ static void sigint_handler(int arg)
 	stop = true;
 }
 
-void server_main(int fd)
+// each output composites to its own gbm surface in a layout its primary
+// plane can scan out
+static void render_init(void)
+{
+	for (int i = 0; i < num_outputs; i++) {
+		struct display_output *output = outputs + i;
+
+		state.target_width = output->width;
+		state.target_height = output->height;
+		state.modifiers = output->output_modifiers;
+		state.num_modifiers = output->output_num_modifiers;
+		if (!i)
+			render_target_init(&state);
+		else
+			render_surface_init(&state);
+
+		output->gs = state.gs;
+		output->surface = state.surface;
+
+		// first frame covers the whole output, which also lights up
+		// crtcs that were off
+		damage_output(output);
+	}
+}
+
+void server_main(int listen_fd, struct server_config *server_config)
 {
+	config = *server_config;
+
 	// register CTRL+C terminate interrupt
 	signal(SIGINT, sigint_handler);
+	// client may disconnect while sending message to it
+	signal(SIGPIPE, SIG_IGN);
 
 	// init display
 	display_init();
@@ -383,8 +2845,14 @@ void server_main(int fd)
 	atomic_mode_setting_init();
 
 	// init render
-	render_target_init(&state);
+	render_init();
+	if (epoxy_has_gl_extension("GL_OES_EGL_image_external")) {
+		init_gles(&state, vertex_shader, external_fragment_shader);
+		external_program = state.program;
+	}
 	init_gles(&state, vertex_shader, fragment_shader);
+	damage_init();
+	import_init();
 
 	// background color
 	glClearColor(0.15, 0.15, 0.15, 0);
@@ -393,9 +2861,12 @@ void server_main(int fd)
 	assert(dispatch_fd >= 0);
 
 	dispatch_add(drm_fd);
-	dispatch_add(fd);
+	for (int i = 0; i < num_outputs; i++) {
+		repaint_init(outputs + i);
+		dispatch_add(outputs[i].repaint_timer_fd);
+	}
+	dispatch_add(listen_fd);
 
-	bool client_added = true;
 	while (!stop) {
 		struct epoll_event events[64];
 
@@ -405,42 +2876,67 @@ void server_main(int fd)
 
 		for (int i = 0; i < n; i++) {
 			int efd = events[i].data.fd;
-
-			assert(events[i].events == EPOLLIN);
+			struct display_output *output;
+			struct client *client;
+			struct fenced_frame *fenced;
 
 			if (efd == drm_fd) {
+				assert(events[i].events == EPOLLIN);
+
 				drmEventContext ev = {
 					.version = DRM_EVENT_CONTEXT_VERSION,
-					.page_flip_handler = page_flip_handler,
+					.page_flip_handler2 = page_flip_handler,
 				};
 				assert(!drmHandleEvent(efd, &ev));
-			} else if (efd == fd) {
-				// get client output and past on fb
-				int signal_fd = composite(fd);
-
-				// show on screen
-				display_output(signal_fd);
-			} else {
-				fprintf(stderr, "invalid epoll event fd %d\n", efd);
-				exit(1);
+			} else if ((output = repaint_output(efd))) {
+				repaint(output);
+			} else if (efd == listen_fd) {
+				client_accept(listen_fd);
+			} else if ((client = client_find(efd))) {
+				if (!client->dead)
+					client_dispatch(client);
+			} else if ((fenced = fence_find(efd, &client))) {
+				if (!client->dead)
+					fence_dispatch(client, fenced);
 			}
+			// otherwise fd is closed by an earlier event of this round,
+			// like fence of a frame dropped for a newer one
 		}
 
-		if (gbm_surface_has_free_buffers(state.gs)) {
-			if (!client_added) {
-				dispatch_add(fd);
-				client_added = true;
-			}
-		} else {
-			// does not handle new client request if no free framebuffer
-			if (client_added) {
-				dispatch_remove(fd);
-				client_added = false;
-			}
+		// remove clients after all events of this round are handled,
+		// so that their fds are not closed and reused in between
+		for (struct client *client = clients, *next; client; client = next) {
+			next = client->next;
+			if (client->dead)
+				client_remove(client);
+		}
+
+		// new frames or frames held for target need repaint, there
+		// will be page flip event to wake up when no free framebuffer
+		for (int i = 0; i < num_outputs; i++) {
+			struct display_output *output = outputs + i;
+			if (!can_queue_frame(output))
+				continue;
+			if (need_composite(output))
+				schedule_repaint(output, false);
+			else if (has_held_frame(output))
+				schedule_repaint(output, true);
 		}
 	}
 
-	// restore previous fb
-	assert(!drmModeSetCrtc(drm_fd, crtc->crtc_id, orig_fb->fb_id, 0, 0,
-			       &connector->connector_id, 1, &crtc->mode));
+	while (clients)
+		client_remove(clients);
+
+	for (int i = 0; i < num_outputs; i++) {
+		struct display_output *output = outputs + i;
+		drmModeCrtcPtr crtc = output->crtc;
+
+		// restore previous fb, or turn off crtc lit up by us
+		if (output->orig_fb)
+			assert(!drmModeSetCrtc(drm_fd, crtc->crtc_id, output->orig_fb->fb_id,
+					       0, 0, &output->connector->connector_id, 1,
+					       &crtc->mode));
+		else
+			assert(!drmModeSetCrtc(drm_fd, crtc->crtc_id, 0, 0, 0, NULL, 0, NULL));
+	}
 }
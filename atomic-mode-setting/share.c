@@ -1,14 +1,30 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/sync_file.h>
+
+#include <xf86drm.h>
 
 #include "share.h"
 
+// kernel headers before 6.3 lack fence deadline
+#ifndef SYNC_IOC_SET_DEADLINE
+struct sync_set_deadline {
+	__u64 deadline_ns;
+	__u64 pad;
+};
+#define SYNC_IOC_SET_DEADLINE _IOW(SYNC_IOC_MAGIC, 5, struct sync_set_deadline)
+#endif
+
 ssize_t
 sock_fd_write(int sock, void *buf, ssize_t buflen, int *fds, int num_fd)
 {
@@ -75,9 +91,11 @@ sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fds, int *num_fd)
         msg.msg_control = cmsgu.control;
         msg.msg_controllen = sizeof(cmsgu.control);
         size = recvmsg (sock, &msg, 0);
+        // peer may reset the connection, caller decides what to do
         if (size < 0) {
             perror ("recvmsg");
-            exit(1);
+            *num_fd = 0;
+            return size;
         }
 
 	int offset = 0;
@@ -86,19 +104,22 @@ sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fds, int *num_fd)
 		for (hdr = CMSG_FIRSTHDR(&msg); hdr; hdr = CMSG_NXTHDR(&msg, hdr)) {
 			if (hdr->cmsg_level == SOL_SOCKET && hdr->cmsg_type == SCM_RIGHTS) {
 				int nfd = (hdr->cmsg_len - CMSG_LEN(0)) / sizeof (int);
-				assert(nfd <= max_fds - offset);
-				memcpy(fds + offset, CMSG_DATA(hdr), nfd * sizeof (int));
-				offset += nfd;
+				int *data = (int *)CMSG_DATA(hdr);
+				// more fds than expected, close the extra ones
+				for (int i = 0; i < nfd; i++) {
+					if (offset < max_fds)
+						fds[offset++] = data[i];
+					else
+						close(data[i]);
+				}
 			}
 		}
 	}
 	*num_fd = offset;
     } else {
         size = read (sock, buf, bufsize);
-        if (size < 0) {
+        if (size < 0)
             perror("read");
-            exit(1);
-        }
     }
     return size;
 }
@@ -142,6 +163,28 @@ static EGLConfig get_config(struct render_state *s)
 	abort();
 }
 
+// create another target of the size on initialized display, all targets
+// share the same context
+void render_surface_init(struct render_state *s)
+{
+	EGLConfig config = get_config(s);
+
+	// driver picks the best layout among modifiers, tiled or compressed
+	// ones save memory bandwidth compared to linear
+	if (s->num_modifiers)
+		s->gs = gbm_surface_create_with_modifiers(
+			s->gbm, s->target_width, s->target_height, GBM_FORMAT_ARGB8888,
+			s->modifiers, s->num_modifiers);
+	else
+		s->gs = gbm_surface_create(
+			s->gbm, s->target_width, s->target_height, GBM_BO_FORMAT_ARGB8888,
+			GBM_BO_USE_LINEAR|GBM_BO_USE_SCANOUT|GBM_BO_USE_RENDERING);
+	assert(s->gs);
+
+	s->surface = eglCreatePlatformWindowSurfaceEXT(s->display, config, s->gs, NULL);
+	assert(s->surface != EGL_NO_SURFACE);
+}
+
 void render_target_init(struct render_state *s)
 {
 	assert(epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_gbm"));
@@ -158,15 +201,12 @@ void render_target_init(struct render_state *s)
 
 	assert(eglBindAPI(EGL_OPENGL_ES_API) == EGL_TRUE);
 
-	EGLConfig config = get_config(s);
-
-	s->gs = gbm_surface_create(
-		s->gbm, s->target_width, s->target_height, GBM_BO_FORMAT_ARGB8888,
-		GBM_BO_USE_LINEAR|GBM_BO_USE_SCANOUT|GBM_BO_USE_RENDERING);
-	assert(s->gs);
+	if (!s->surfaceless)
+		render_surface_init(s);
+	else
+		assert(epoxy_has_egl_extension(s->display, "EGL_KHR_surfaceless_context"));
 
-	s->surface = eglCreatePlatformWindowSurfaceEXT(s->display, config, s->gs, NULL);
-	assert(s->surface != EGL_NO_SURFACE);
+	EGLConfig config = get_config(s);
 
 	const EGLint contextAttribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -175,7 +215,8 @@ void render_target_init(struct render_state *s)
 	s->context = eglCreateContext(s->display, config, EGL_NO_CONTEXT, contextAttribs);
 	assert(s->context != EGL_NO_CONTEXT);
 
-	assert(eglMakeCurrent(s->display, s->surface, s->surface, s->context) == EGL_TRUE);
+	EGLSurface surface = s->surfaceless ? EGL_NO_SURFACE : s->surface;
+	assert(eglMakeCurrent(s->display, surface, surface, s->context) == EGL_TRUE);
 }
 
 static GLuint compile_shader(const char *source, GLenum type)
@@ -267,28 +308,225 @@ int get_fence(EGLDisplay display)
 	return ret;
 }
 
+int merge_fence(int fd1, int fd2)
+{
+	if (fd1 < 0)
+		return fd2;
+	if (fd2 < 0)
+		return fd1;
+
+	struct sync_merge_data data = {
+		.name = "merged",
+		.fd2 = fd2,
+	};
+	assert(!ioctl(fd1, SYNC_IOC_MERGE, &data));
+
+	close(fd1);
+	close(fd2);
+	return data.fence;
+}
+
+void set_fence_deadline(int fd, uint64_t time)
+{
+	struct sync_set_deadline data = {
+		.deadline_ns = time,
+	};
+	// hint only, old kernel or driver without support ignores it
+	ioctl(fd, SYNC_IOC_SET_DEADLINE, &data);
+}
+
+int syncobj_export(int fd, uint32_t transfer, uint32_t syncobj, uint64_t point)
+{
+	// point without fence submitted yet fails
+	int fence_fd;
+	if (drmSyncobjTransfer(fd, transfer, 0, syncobj, point, 0) ||
+	    drmSyncobjExportSyncFile(fd, transfer, &fence_fd))
+		return -1;
+	return fence_fd;
+}
+
+void syncobj_import(int fd, uint32_t transfer, uint32_t syncobj, uint64_t point,
+		    int fence_fd)
+{
+	if (fence_fd < 0) {
+		assert(!drmSyncobjTimelineSignal(fd, &syncobj, &point, 1));
+		return;
+	}
+
+	assert(!drmSyncobjImportSyncFile(fd, transfer, fence_fd));
+	close(fence_fd);
+	assert(!drmSyncobjTransfer(fd, syncobj, point, transfer, 0, 0));
+}
+
+uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int listen_socket(void)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_LOCAL,
+		.sun_path = SOCKET_PATH,
+	};
+
+	int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	// remove stale socket left by previous server
+	unlink(SOCKET_PATH);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	if (listen(fd, 16) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	return fd;
+}
+
+static int connect_socket(void)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_LOCAL,
+		.sun_path = SOCKET_PATH,
+	};
+
+	int fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	return fd;
+}
+
+static void run_server(int fd, struct server_config *config)
+{
+	server_main(fd, config);
+
+	close(fd);
+	unlink(SOCKET_PATH);
+}
+
+// usage:
+//   atomic-mode-setting                  run server with one client
+//   atomic-mode-setting server [fifo|mailbox] [sync] [vrr] [tearing]
+//                              [repaint-offset=usec]
+//                                        run server only with present mode,
+//                                        outputs flipped together or not,
+//                                        variable refresh rate, async flips,
+//                                        and time to composite before vblank
+//   atomic-mode-setting client [syncobj] [buffers=n] [x y [interval]]
+//                                        connect a client to running server,
+//                                        show a frame every interval vblanks,
+//                                        pass fences by timeline syncobj,
+//                                        render to a pool of n buffers, at
+//                                        least 2 as server holds the one
+//                                        on screen
+//   atomic-mode-setting client [syncobj] [buffers=n] fullscreen [interval]
+//                                        client covers the whole output
 int
 main(int argc, char **argv)
 {
-	int sv[2];
+	int fd;
 	int pid;
+	struct server_config config = {
+		.present_mode = PRESENT_MODE_FIFO,
+	};
 
-	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
-		perror("socketpair");
-		exit(1);
+	if (argc > 1 && !strcmp(argv[1], "server")) {
+		for (int i = 2; i < argc; i++) {
+			if (!strcmp(argv[i], "fifo"))
+				config.present_mode = PRESENT_MODE_FIFO;
+			else if (!strcmp(argv[i], "mailbox"))
+				config.present_mode = PRESENT_MODE_MAILBOX;
+			else if (!strcmp(argv[i], "sync"))
+				config.sync_outputs = true;
+			else if (!strcmp(argv[i], "vrr"))
+				config.vrr = true;
+			else if (!strcmp(argv[i], "tearing"))
+				config.tearing = true;
+			else if (!strncmp(argv[i], "repaint-offset=", 15))
+				config.repaint_offset = atoi(argv[i] + 15);
+			else {
+				fprintf(stderr, "unknown server option %s\n", argv[i]);
+				exit(1);
+			}
+		}
+
+		run_server(listen_socket(), &config);
+		return 0;
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "client")) {
+		struct client_config client_config = {
+			.x = 128,
+			.y = 128,
+			.interval = 1,
+			.num_buffers = 3,
+		};
+		int arg = 2;
+		if (argc > arg && !strcmp(argv[arg], "syncobj")) {
+			client_config.syncobj = true;
+			arg++;
+		}
+		if (argc > arg && !strncmp(argv[arg], "buffers=", 8)) {
+			client_config.num_buffers = atoi(argv[arg] + 8);
+			arg++;
+		}
+		if (argc > arg && !strcmp(argv[arg], "fullscreen")) {
+			client_config.fullscreen = true;
+			if (argc > arg + 1)
+				client_config.interval = atoi(argv[arg + 1]);
+		} else if (argc > arg + 1) {
+			client_config.x = atoi(argv[arg]);
+			client_config.y = atoi(argv[arg + 1]);
+			if (argc > arg + 2)
+				client_config.interval = atoi(argv[arg + 2]);
+		}
+		if (!client_config.interval)
+			client_config.interval = 1;
+		// server holds current buffer until another one replaces it
+		if (client_config.num_buffers < 2)
+			client_config.num_buffers = 2;
+
+		client_main(connect_socket(), &client_config);
+		return 0;
 	}
 
+	// listen before fork so that client can connect at once
+	fd = listen_socket();
+
 	switch ((pid = fork())) {
-	case 0:
-		close(sv[0]);
-		client_main(sv[1]);
+	case 0: {
+		struct client_config client_config = {
+			.x = 128,
+			.y = 128,
+			.interval = 1,
+			.num_buffers = 3,
+		};
+		close(fd);
+		client_main(connect_socket(), &client_config);
 		break;
+	}
 	case -1:
 		perror("fork");
 		exit(1);
 	default:
-		close(sv[1]);
-		server_main(sv[0]);
+		run_server(fd, &config);
 		break;
 	}
 	return 0;
@@ -6,19 +6,128 @@
 #include <epoxy/gl.h>
 #include <epoxy/egl.h>
 
-struct present_buffer {
-	uint32_t x, y;
-        uint32_t width;
+enum message_type {
+	MESSAGE_REGISTER_BUFFER,
+	MESSAGE_BUFFER_REGISTERED,
+	MESSAGE_PRESENT_BUFFER,
+	MESSAGE_PRESENT_DONE,
+	MESSAGE_PRESENT_FEEDBACK,
+	MESSAGE_PRESENT_SKIPPED,
+	MESSAGE_OUTPUT,
+	MESSAGE_REGISTER_TIMELINE,
+};
+
+#define MAX_BUFFER_PLANES 4
+
+// sent once for each client buffer with its dma-buf fds attached, either
+// one shared by all planes or one for each plane, planes of YUV formats
+// like NV12 are sampled and scanned out without conversion
+struct register_buffer {
+	uint32_t width;
 	uint32_t height;
-	uint32_t stride;
 	uint32_t format;
+	// DRM_FORMAT_MOD_INVALID when the layout is implicit
+	uint64_t modifier;
+	uint32_t num_planes;
+	uint32_t strides[MAX_BUFFER_PLANES];
+	uint32_t offsets[MAX_BUFFER_PLANES];
+};
+
+// reply of register_buffer, id is used to present the buffer afterwards
+struct buffer_registered {
+	uint32_t id;
+};
+
+#define MAX_DAMAGE_RECTS 8
+
+// in buffer coordinates with origin at top left
+struct damage_rect {
+	int32_t x, y;
+	int32_t width;
+	int32_t height;
+};
+
+struct present_buffer {
+	uint32_t x, y;
+	uint32_t id;
 	uint64_t index;
+	// vblank sequence and CLOCK_MONOTONIC time in nanoseconds the frame
+	// should be shown at, frame is held until then, 0 means no target
+	uint64_t target_sequence;
+	uint64_t target_time;
+	// point of acquire timeline signaled when render of the frame is
+	// done, 0 when a fence fd is attached instead or none
+	uint64_t acquire_point;
+	// area changed since previous frame, none means whole buffer
+	uint32_t num_damage;
+	struct damage_rect damage[MAX_DAMAGE_RECTS];
 };
 
+// buffer can be reused after the attached fence is signaled, if any, which
+// is merged from composite of each output done and the buffer no longer
+// scanned out
 struct present_done {
+	// buffer id and index of its latest present
+	uint32_t id;
+	uint64_t index;
+	// point of release timeline carrying the fence instead, 0 if client
+	// has no timelines
+	uint64_t release_point;
+};
+
+// sent when the frame is shown on screen
+struct present_feedback {
+	uint32_t id;
+	uint64_t index;
+	// vblank sequence of the page flip
+	uint64_t sequence;
+	// CLOCK_MONOTONIC time of the page flip in nanoseconds
+	uint64_t timestamp;
+	// refresh period of the display in nanoseconds
+	uint64_t refresh;
+};
+
+// sent when the frame is replaced by a newer one before shown on screen
+struct present_skipped {
 	uint64_t index;
 };
 
+#define MAX_MODIFIERS 16
+
+// sent once when client connects
+struct output {
+	uint32_t width;
+	uint32_t height;
+	// refresh period of the display in nanoseconds
+	uint64_t refresh;
+	// layouts of ARGB8888 the primary plane can scan out, buffers
+	// allocated with one of them can go on screen directly, none
+	// means only linear is known to work
+	uint32_t num_modifiers;
+	uint64_t modifiers[MAX_MODIFIERS];
+};
+
+// sent once before any present with acquire and release timeline
+// drm_syncobj fds attached, then frames and present done only carry
+// timeline points instead of sync_file fds
+struct register_timeline {
+	uint32_t reserved;
+};
+
+struct message {
+	uint32_t type;
+	union {
+		struct register_buffer register_buffer;
+		struct buffer_registered buffer_registered;
+		struct present_buffer present_buffer;
+		struct present_done present_done;
+		struct present_feedback present_feedback;
+		struct present_skipped present_skipped;
+		struct output output;
+		struct register_timeline register_timeline;
+	};
+};
+
 struct render_state {
 	int fd;
 
@@ -31,18 +140,78 @@ struct render_state {
 
 	int target_width;
 	int target_height;
+	// only create the context, user renders to its own buffers through
+	// fbos instead of a window surface
+	bool surfaceless;
+	// layouts target buffers may be allocated with, linear if none
+	uint64_t *modifiers;
+	int num_modifiers;
 };
 
 ssize_t sock_fd_write(int sock, void *buf, ssize_t buflen, int *fds, int num_fd);
 ssize_t sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fds, int *num_fd);
 
-void client_main(int fd);
-void server_main(int fd);
+// path of the listening socket clients connect to
+#define SOCKET_PATH "/tmp/atomic-mode-setting.socket"
+
+struct client_config {
+	uint32_t x, y;
+	// show a frame every interval vblanks
+	uint32_t interval;
+	// cover the whole output, which lets server scan out client buffers
+	// directly
+	bool fullscreen;
+	// pass fences by timeline syncobj points instead of sync_file fds
+	bool syncobj;
+	// size of buffer pool, more buffers let client render ahead at the
+	// cost of memory
+	uint32_t num_buffers;
+};
+
+void client_main(int fd, struct client_config *config);
+enum present_mode {
+	// queue every output frame and show one per vblank
+	PRESENT_MODE_FIFO,
+	// newer output frame replaces the one waiting for vblank
+	PRESENT_MODE_MAILBOX,
+};
+
+struct server_config {
+	enum present_mode present_mode;
+	// microseconds before vblank to composite, 0 means auto tune
+	uint32_t repaint_offset;
+	// flip all outputs in one atomic commit, so that matched displays
+	// show their frames at the same vblank
+	bool sync_outputs;
+	// refresh panels supporting variable refresh rate as soon as a frame
+	// is ready instead of at fixed vblanks
+	bool vrr;
+	// show new frames at once with async flips, which may tear
+	bool tearing;
+};
+
+void server_main(int listen_fd, struct server_config *config);
 
 void render_target_init(struct render_state *s);
+void render_surface_init(struct render_state *s);
 void init_gles(struct render_state *s, const char *vertex_shader,
 	       const char *fragment_shader);
 void wait_fence(EGLDisplay display, int fd);
 int get_fence(EGLDisplay display);
+// hint driver that fence should be signaled by CLOCK_MONOTONIC time in
+// nanoseconds, so it can boost clocks when the work is late
+void set_fence_deadline(int fd, uint64_t time);
+// sync_file signaled when both are, takes ownership of them, either may
+// be -1
+int merge_fence(int fd1, int fd2);
+// move fences between timeline syncobj points and sync_files of drm fd
+// through binary syncobj transfer, point must have its fence submitted
+// before export or it returns -1, import takes ownership of fence_fd and signals point at
+// once when it's -1
+int syncobj_export(int fd, uint32_t transfer, uint32_t syncobj, uint64_t point);
+void syncobj_import(int fd, uint32_t transfer, uint32_t syncobj, uint64_t point,
+		    int fence_fd);
+// CLOCK_MONOTONIC time in nanoseconds
+uint64_t get_time_ns(void);
 
 #endif
@@ -27,14 +27,8 @@ static const char fragment_shader[] =
 	"    gl_FragColor = vec4(1.0, 0.0, 0.0, 1);"
 	"}";
 
-static int render(uint64_t index, int wait_fd)
+static int render(uint64_t index)
 {
-	// start GPU task after server is done with this render buffer
-	if (wait_fd >= 0) {
-		wait_fence(state.display, wait_fd);
-		close(wait_fd);
-	}
-
 	GLfloat vertex[] = {
 		-1, -1, 0,
 		-1, 1, 0,
@@ -76,52 +70,118 @@ static int render(uint64_t index, int wait_fd)
 #define MAX_BOS 32
 static struct gbm_bo *busy_bos[MAX_BOS] = {0};
 
-static void present(int fd, int signal_fd, uint64_t index)
+static void release_buffer(struct present_done *data, int wait_fd)
 {
-	struct gbm_bo *bo = gbm_surface_lock_front_buffer(state.gs);
+	struct gbm_bo *bo = busy_bos[data->index % MAX_BOS];
+	busy_bos[data->index % MAX_BOS] = NULL;
 	assert(bo);
 
-	struct present_buffer data = {
-		.x = 128,
-		.y = 128,
-		.width = gbm_bo_get_width(bo),
-		.height = gbm_bo_get_height(bo),
-		.stride = gbm_bo_get_stride(bo),
-		.format = gbm_bo_get_format(bo),
-		.index = index,
+	gbm_surface_release_buffer(state.gs, bo);
+
+	// start following GPU task after server is done with this buffer
+	if (wait_fd >= 0) {
+		wait_fence(state.display, wait_fd);
+		close(wait_fd);
+	}
+}
+
+// handle one message from server and return its type
+static uint32_t receive(int fd, struct message *msg)
+{
+	int wait_fd = -1;
+	int num_fd = 1;
+	ssize_t size = sock_fd_read(fd, msg, sizeof(*msg), &wait_fd, &num_fd);
+	assert(size > 0);
+	assert(num_fd <= 1);
+
+	switch (msg->type) {
+	case MESSAGE_BUFFER_REGISTERED:
+		break;
+	case MESSAGE_PRESENT_DONE:
+		release_buffer(&msg->present_done, num_fd ? wait_fd : -1);
+		break;
+	default:
+		fprintf(stderr, "invalid server message %d\n", msg->type);
+		exit(1);
+	}
+	return msg->type;
+}
+
+struct buffer {
+	uint32_t id;
+};
+
+static void destroy_buffer(struct gbm_bo *bo, void *data)
+{
+	free(data);
+}
+
+// send bo to server once, later presents only carry the returned id
+static struct buffer *register_buffer(int fd, struct gbm_bo *bo)
+{
+	struct message msg = {
+		.type = MESSAGE_REGISTER_BUFFER,
+		.register_buffer = {
+			.width = gbm_bo_get_width(bo),
+			.height = gbm_bo_get_height(bo),
+			.stride = gbm_bo_get_stride(bo),
+			.format = gbm_bo_get_format(bo),
+		},
 	};
 
-	int fds[2] = { gbm_bo_get_fd(bo), signal_fd };
-	int num_fd = signal_fd >= 0 ? 2 : 1;
-	ssize_t size = sock_fd_write(fd, &data, sizeof(data), fds, num_fd);
+	int bo_fd = gbm_bo_get_fd(bo);
+	ssize_t size = sock_fd_write(fd, &msg, sizeof(msg), &bo_fd, 1);
 	assert(size > 0);
 
 	// close after usage
-	close(fds[0]);
-	if (signal_fd >= 0)
-		close(signal_fd);
+	close(bo_fd);
 
-	busy_bos[index % MAX_BOS] = bo;
+	// present done of previous frames may arrive before the reply
+	while (receive(fd, &msg) != MESSAGE_BUFFER_REGISTERED);
+
+	struct buffer *buffer = malloc(sizeof(*buffer));
+	assert(buffer);
+	buffer->id = msg.buffer_registered.id;
+	gbm_bo_set_user_data(bo, buffer, destroy_buffer);
+	return buffer;
 }
 
-static int get_free_buffer(int fd)
+static void present(int fd, int signal_fd, uint64_t index)
 {
-	if (gbm_surface_has_free_buffers(state.gs))
-		return -1;
+	struct gbm_bo *bo = gbm_surface_lock_front_buffer(state.gs);
+	assert(bo);
 
-	int wait_fd = -1;
-	int num_fd = 1;
-	struct present_done data;
-	ssize_t size = sock_fd_read(fd, &data, sizeof(data), &wait_fd, &num_fd);
+	struct buffer *buffer = gbm_bo_get_user_data(bo);
+	if (!buffer)
+		buffer = register_buffer(fd, bo);
+
+	struct message msg = {
+		.type = MESSAGE_PRESENT_BUFFER,
+		.present_buffer = {
+			.x = 128,
+			.y = 128,
+			.id = buffer->id,
+			.index = index,
+		},
+	};
+
+	ssize_t size;
+	if (signal_fd >= 0) {
+		size = sock_fd_write(fd, &msg, sizeof(msg), &signal_fd, 1);
+		close(signal_fd);
+	} else
+		size = sock_fd_write(fd, &msg, sizeof(msg), NULL, 0);
 	assert(size > 0);
-	assert(num_fd <= 1);
 
-	struct gbm_bo *bo = busy_bos[data.index % MAX_BOS];
-	busy_bos[data.index % MAX_BOS] = NULL;
-	assert(bo);
+	busy_bos[index % MAX_BOS] = bo;
+}
 
-	gbm_surface_release_buffer(state.gs, bo);
-	return wait_fd;
+static void get_free_buffer(int fd)
+{
+	struct message msg;
+
+	while (!gbm_surface_has_free_buffers(state.gs))
+		receive(fd, &msg);
 }
 
 void client_main(int fd)
@@ -139,10 +199,10 @@ void client_main(int fd)
 	for (uint64_t i = 0; true; i++) {
 		// ensure back buffer is free and release buffer when receive
 		// present done from server
-		int wait_fd = get_free_buffer(fd);
+		get_free_buffer(fd);
 
 		// do OpenGL rendering
-		int signal_fd = render(i, wait_fd);
+		int signal_fd = render(i);
 
 		// send to server for display
 		present(fd, signal_fd, i);
@@ -78,59 +78,85 @@ static const char fragment_shader[] =
 	"    gl_FragColor = texture2D(texMap, texcoord);\n"
 	"}\n";
 
-static void composite(int fd)
-{
-	struct present_buffer data;
-	int fds[2];
-	int num_fd = 2;
+struct client_buffer {
+	struct gbm_bo *bo;
+	EGLImageKHR image;
+	GLuint texid;
+	uint32_t width;
+	uint32_t height;
+};
 
-	// get new window frame from client
-	ssize_t size = sock_fd_read(fd, &data, sizeof(data), fds, &num_fd);
-	assert(size > 0);
-	assert(num_fd >= 1);
+// assume max number of buffers registered by client is less than 32
+#define MAX_CLIENT_BUFFERS 32
+static struct client_buffer client_buffers[MAX_CLIENT_BUFFERS] = {0};
+
+static void register_buffer(int fd, struct register_buffer *data, int buffer_fd)
+{
+	// find a free slot, its index is the buffer id
+	uint32_t id;
+	for (id = 0; id < MAX_CLIENT_BUFFERS; id++) {
+		if (!client_buffers[id].bo)
+			break;
+	}
+	assert(id < MAX_CLIENT_BUFFERS);
 
-	int buffer_fd = fds[0];
-	int wait_fd = num_fd == 2 ? fds[1] : -1;
+	struct client_buffer *buffer = client_buffers + id;
 
 	struct gbm_import_fd_data gbm_data = {
 		.fd = buffer_fd,
-		.width = data.width,
-		.height = data.height,
-		.stride = data.stride,
-		.format = data.format,
+		.width = data->width,
+		.height = data->height,
+		.stride = data->stride,
+		.format = data->format,
 	};
 
-	struct gbm_bo *bo = gbm_bo_import(
+	buffer->bo = gbm_bo_import(
 		state.gbm, GBM_BO_IMPORT_FD,
 		&gbm_data, GBM_BO_USE_RENDERING);
-	assert(bo);
+	assert(buffer->bo);
 
 	// close after usage
 	close(buffer_fd);
 
 	epoxy_has_egl_extension(state.display, "EGL_KHR_image_pixmap");
 
-	EGLImageKHR image = eglCreateImageKHR(
+	buffer->image = eglCreateImageKHR(
 		state.display, state.context,
-		EGL_NATIVE_PIXMAP_KHR, bo, NULL);
-	assert(image != EGL_NO_IMAGE_KHR);
-
-	// destroy after usage
-	gbm_bo_destroy(bo);
-
-	glActiveTexture(GL_TEXTURE0);
+		EGL_NATIVE_PIXMAP_KHR, buffer->bo, NULL);
+	assert(buffer->image != EGL_NO_IMAGE_KHR);
 
 	epoxy_has_gl_extension("GL_OES_EGL_image");
 
-	GLuint texid;
-	glGenTextures(1, &texid);
-	glBindTexture(GL_TEXTURE_2D, texid);
+	// texture keeps sampling the client buffer, so it lives as long
+	// as the buffer is registered
+	glGenTextures(1, &buffer->texid);
+	glBindTexture(GL_TEXTURE_2D, buffer->texid);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, buffer->image);
+
+	buffer->width = data->width;
+	buffer->height = data->height;
+
+	// tell client the id of this buffer
+	struct message reply = {
+		.type = MESSAGE_BUFFER_REGISTERED,
+		.buffer_registered = {
+			.id = id,
+		},
+	};
+	ssize_t size = sock_fd_write(fd, &reply, sizeof(reply), NULL, 0);
+	assert(size > 0);
+}
 
-	// destroy after usage
-	eglDestroyImageKHR(state.display, image);
+static void composite(int fd, struct present_buffer *data, int wait_fd)
+{
+	assert(data->id < MAX_CLIENT_BUFFERS);
+	struct client_buffer *buffer = client_buffers + data->id;
+	assert(buffer->bo);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, buffer->texid);
 
 	// wait client render is done before composite
 	if (wait_fd >= 0) {
@@ -138,10 +164,10 @@ static void composite(int fd)
 		close(wait_fd);
 	}
 
-	GLfloat x = -1.0 + data.x * 2.0 / state.target_width;
-	GLfloat y = 1.0 - data.y * 2.0 / state.target_height;
-	GLfloat w = x + data.width * 2.0 / state.target_width;
-	GLfloat h = y - data.height * 2.0 / state.target_height;
+	GLfloat x = -1.0 + data->x * 2.0 / state.target_width;
+	GLfloat y = 1.0 - data->y * 2.0 / state.target_height;
+	GLfloat w = x + buffer->width * 2.0 / state.target_width;
+	GLfloat h = y - buffer->height * 2.0 / state.target_height;
 		
 	GLfloat vertex[] = {
 		x, h, 0,
@@ -183,13 +209,14 @@ static void composite(int fd)
 	// swap back buffer to front
 	eglSwapBuffers(state.display, state.surface);
 
-	// delete after usage
-	glDeleteTextures(1, &texid);
-
 	// infom client window frame has been consumed
-	struct present_done done = {
-		.index = data.index,
+	struct message done = {
+		.type = MESSAGE_PRESENT_DONE,
+		.present_done = {
+			.index = data->index,
+		},
 	};
+	ssize_t size;
 	if (signal_fd >= 0) {
 		size = sock_fd_write(fd, &done, sizeof(done), &signal_fd, 1);
 		close(signal_fd);
@@ -268,6 +295,34 @@ page_flip_handler(int fd, uint32_t frame, uint32_t sec, uint32_t usec,
 					DRM_MODE_PAGE_FLIP_EVENT, NULL));
 }
 
+static void client_dispatch(int fd)
+{
+	struct message msg;
+	int fds[2];
+	int num_fd = 2;
+
+	ssize_t size = sock_fd_read(fd, &msg, sizeof(msg), fds, &num_fd);
+	assert(size > 0);
+
+	switch (msg.type) {
+	case MESSAGE_REGISTER_BUFFER:
+		assert(num_fd == 1);
+		register_buffer(fd, &msg.register_buffer, fds[0]);
+		break;
+	case MESSAGE_PRESENT_BUFFER: {
+		// get client output and past on fb
+		composite(fd, &msg.present_buffer, num_fd ? fds[0] : -1);
+
+		// show on screen
+		display_output();
+		break;
+	}
+	default:
+		fprintf(stderr, "invalid client message %d\n", msg.type);
+		exit(1);
+	}
+}
+
 static int dispatch_fd;
 
 static void dispatch_add(int fd)
@@ -332,11 +387,7 @@ void server_main(int fd)
 				};
 				assert(!drmHandleEvent(efd, &ev));
 			} else if (efd == fd) {
-				// get client output and past on fb
-				composite(fd);
-
-				// show on screen
-				display_output();
+				client_dispatch(fd);
 			} else {
 				fprintf(stderr, "invalid epoll event fd %d\n", efd);
 				exit(1);
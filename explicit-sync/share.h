@@ -6,12 +6,29 @@
 #include <epoxy/gl.h>
 #include <epoxy/egl.h>
 
-struct present_buffer {
-	uint32_t x, y;
-        uint32_t width;
+enum message_type {
+	MESSAGE_REGISTER_BUFFER,
+	MESSAGE_BUFFER_REGISTERED,
+	MESSAGE_PRESENT_BUFFER,
+	MESSAGE_PRESENT_DONE,
+};
+
+// sent once for each client buffer with its dma-buf fd attached
+struct register_buffer {
+	uint32_t width;
 	uint32_t height;
 	uint32_t stride;
 	uint32_t format;
+};
+
+// reply of register_buffer, id is used to present the buffer afterwards
+struct buffer_registered {
+	uint32_t id;
+};
+
+struct present_buffer {
+	uint32_t x, y;
+	uint32_t id;
 	uint64_t index;
 };
 
@@ -19,6 +36,16 @@ struct present_done {
 	uint64_t index;
 };
 
+struct message {
+	uint32_t type;
+	union {
+		struct register_buffer register_buffer;
+		struct buffer_registered buffer_registered;
+		struct present_buffer present_buffer;
+		struct present_done present_done;
+	};
+};
+
 struct render_state {
 	int fd;
 